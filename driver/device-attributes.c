@@ -0,0 +1,254 @@
+/********************************************************************************
+*  \file       device-attributes.c
+*
+*  \author     Jacopo Fabi
+*
+*  \details    sysfs directory with the state of each minor:
+*              /sys/module/multi_flow_device_driver/devices/<minor>/
+*
+* *******************************************************************************/
+#include "lib/defines.h"
+
+static struct kobject *devices_kobj;
+
+#define to_device(kobj) container_of(kobj, device_manager_t, kobj)
+#define to_minor(kobj) ((int)(to_device(kobj) - devices))
+
+/**
+ * flow_attribute - read-only attribute of a device for a single value
+ * @name:       name of the attribute file
+ * @expr:       value of the attribute, it refers to the device manager
+ */
+#define flow_attribute(name, expr)                                                                      \
+static ssize_t name##_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {             \
+        device_manager_t *device = to_device(kobj);                                                     \
+        return sysfs_emit(buf, "%ld\n", (long)(expr));                                                  \
+}                                                                                                       \
+static struct kobj_attribute name##_attribute = __ATTR_RO(name)
+
+flow_attribute(lp_bytes, device->flow[LOW_PRIORITY].bytes_in_buffer);
+flow_attribute(hp_bytes, device->flow[HIGH_PRIORITY].bytes_in_buffer);
+flow_attribute(lp_threads, atomic_long_read(&(device->flow[LOW_PRIORITY].threads_in_wait)));
+flow_attribute(hp_threads, atomic_long_read(&(device->flow[HIGH_PRIORITY].threads_in_wait)));
+flow_attribute(lp_fill, device->flow[LOW_PRIORITY].fill_state);
+flow_attribute(hp_fill, device->flow[HIGH_PRIORITY].fill_state);
+flow_attribute(lp_reads, device->flow[LOW_PRIORITY].reads);
+flow_attribute(hp_reads, device->flow[HIGH_PRIORITY].reads);
+flow_attribute(lp_writes, device->flow[LOW_PRIORITY].writes);
+flow_attribute(hp_writes, device->flow[HIGH_PRIORITY].writes);
+flow_attribute(pending_bytes, device->pending_bytes);
+flow_attribute(pending_writes, device->pending_writes);
+flow_attribute(lp_borrowed, device->flow[LOW_PRIORITY].borrowed);
+flow_attribute(hp_borrowed, device->flow[HIGH_PRIORITY].borrowed);
+flow_attribute(lp_ttl, device->flow[LOW_PRIORITY].ttl);
+flow_attribute(hp_ttl, device->flow[HIGH_PRIORITY].ttl);
+flow_attribute(lp_expired, device->flow[LOW_PRIORITY].expired_bytes);
+flow_attribute(hp_expired, device->flow[HIGH_PRIORITY].expired_bytes);
+flow_attribute(lp_poll_hits, atomic_long_read(&(device->flow[LOW_PRIORITY].poll_hits)));
+flow_attribute(hp_poll_hits, atomic_long_read(&(device->flow[HIGH_PRIORITY].poll_hits)));
+flow_attribute(lp_poll_misses, atomic_long_read(&(device->flow[LOW_PRIORITY].poll_misses)));
+flow_attribute(hp_poll_misses, atomic_long_read(&(device->flow[HIGH_PRIORITY].poll_misses)));
+flow_attribute(pool_segments, atomic_read(&(device->segments_in_use)));
+flow_attribute(pool_tasks, atomic_read(&(device->tasks_in_use)));
+flow_attribute(pool_chunks, atomic_read(&(device->chunks_in_use)));
+flow_attribute(reserve_segments, READ_ONCE(device->segment_pool->curr_nr));
+flow_attribute(reserve_tasks, READ_ONCE(device->task_pool->curr_nr));
+flow_attribute(reserve_chunks, READ_ONCE(device->chunk_pool->curr_nr));
+
+/**
+ * capacity_show - maximum number of bytes in buffer of each flow, the same for all the devices
+ */
+static ssize_t capacity_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+        return sysfs_emit(buf, "%ld\n", flow_max_bytes);
+}
+
+static struct kobj_attribute capacity_attribute = __ATTR_RO(capacity);
+
+/**
+ * enabled_show - enabling state of the device
+ */
+static ssize_t enabled_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+        return sysfs_emit(buf, "%c\n", to_device(kobj)->enabled ? 'Y' : 'N');
+}
+
+/**
+ * enabled_store - enable or disable the device, already opened sessions are still handled
+ */
+static ssize_t enabled_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count) {
+        bool value;
+        if (kstrtobool(buf, &value)) return -EINVAL;
+        to_device(kobj)->enabled = value;
+        pr_info("Device with minor: %d has been %s\n", to_minor(kobj), value ? "enabled" : "disabled");
+        return count;
+}
+
+static struct kobj_attribute enabled_attribute = __ATTR(enabled, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP, enabled_show, enabled_store);
+
+/**
+ * snapshot_device - consistent snapshot of the state of a device
+ * @minor:      minor number of the device
+ * @status:     structure that is filled with the state of the device
+ *
+ * The op_mutex of both flows is held, so bytes, fill states, counters and pending deferred writes
+ * refer to the same instant; only the threads in wait can change while they are queued.
+ *
+ * Returns:
+ *  - 0 if the snapshot is taken,
+ *  - -EINTR if the wait for the locks was interrupted by a signal.
+ */
+int snapshot_device(int minor, device_status_t *status) {
+        device_manager_t *device = devices + minor;
+        flow_manager_t *flow;
+        int i;
+
+        if (mutex_lock_interruptible(&(device->flow[LOW_PRIORITY].op_mutex))) return -EINTR;
+        if (mutex_lock_interruptible(&(device->flow[HIGH_PRIORITY].op_mutex))) {
+                mutex_unlock(&(device->flow[LOW_PRIORITY].op_mutex));
+                return -EINTR;
+        }
+        memset(status, 0, sizeof(device_status_t));
+        status->enabled = device->enabled;
+        status->pending_writes = device->pending_writes;
+        status->pending_bytes = device->pending_bytes;
+        status->capacity = flow_max_bytes;
+        status->pool_segments = atomic_read(&(device->segments_in_use));
+        status->pool_tasks = atomic_read(&(device->tasks_in_use));
+        status->pool_chunks = atomic_read(&(device->chunks_in_use));
+        status->reserve_segments = READ_ONCE(device->segment_pool->curr_nr);
+        status->reserve_tasks = READ_ONCE(device->task_pool->curr_nr);
+        status->reserve_chunks = READ_ONCE(device->chunk_pool->curr_nr);
+        for (i = 0; i < FLOWS; i++) {
+                flow = &(device->flow[i]);
+                status->bytes[i] = flow->bytes_in_buffer;
+                status->threads[i] = atomic_long_read(&(flow->threads_in_wait));
+                status->fill[i] = flow->fill_state;
+                status->borrowed[i] = flow->borrowed;
+                status->ttl[i] = flow->ttl;
+                status->expired[i] = flow->expired_bytes;
+                status->reads[i] = flow->reads;
+                status->writes[i] = flow->writes;
+                status->poll_hits[i] = atomic_long_read(&(flow->poll_hits));
+                status->poll_misses[i] = atomic_long_read(&(flow->poll_misses));
+        }
+        mutex_unlock(&(device->flow[HIGH_PRIORITY].op_mutex));
+        mutex_unlock(&(device->flow[LOW_PRIORITY].op_mutex));
+        return 0;
+}
+
+/**
+ * status_show - consistent snapshot of all the attributes of the device (see snapshot_device)
+ */
+static ssize_t status_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+        device_status_t status;
+        int res;
+
+        res = snapshot_device(to_minor(kobj), &status);
+        if (res) return res;
+        return sysfs_emit(buf, "enabled %c\ncapacity %lld\n"
+                       "lp_bytes %lld\nhp_bytes %lld\nlp_threads %lld\nhp_threads %lld\nlp_fill %u\nhp_fill %u\n"
+                       "lp_borrowed %lld\nhp_borrowed %lld\nlp_ttl %llu\nhp_ttl %llu\nlp_expired %llu\nhp_expired %llu\n"
+                       "lp_reads %llu\nhp_reads %llu\nlp_writes %llu\nhp_writes %llu\npending_bytes %lld\npending_writes %u\n"
+                       "lp_poll_hits %llu\nhp_poll_hits %llu\nlp_poll_misses %llu\nhp_poll_misses %llu\n"
+                       "pool_segments %u\npool_tasks %u\npool_chunks %u\nreserve_segments %u\nreserve_tasks %u\nreserve_chunks %u\n",
+                       status.enabled ? 'Y' : 'N', status.capacity,
+                       status.bytes[LOW_PRIORITY], status.bytes[HIGH_PRIORITY],
+                       status.threads[LOW_PRIORITY], status.threads[HIGH_PRIORITY],
+                       status.fill[LOW_PRIORITY], status.fill[HIGH_PRIORITY],
+                       status.borrowed[LOW_PRIORITY], status.borrowed[HIGH_PRIORITY],
+                       status.ttl[LOW_PRIORITY], status.ttl[HIGH_PRIORITY],
+                       status.expired[LOW_PRIORITY], status.expired[HIGH_PRIORITY],
+                       status.reads[LOW_PRIORITY], status.reads[HIGH_PRIORITY],
+                       status.writes[LOW_PRIORITY], status.writes[HIGH_PRIORITY],
+                       status.pending_bytes, status.pending_writes,
+                       status.poll_hits[LOW_PRIORITY], status.poll_hits[HIGH_PRIORITY],
+                       status.poll_misses[LOW_PRIORITY], status.poll_misses[HIGH_PRIORITY],
+                       status.pool_segments, status.pool_tasks, status.pool_chunks,
+                       status.reserve_segments, status.reserve_tasks, status.reserve_chunks);
+}
+
+static struct kobj_attribute status_attribute = __ATTR_RO(status);
+
+static struct attribute *device_attrs[] = {
+        &enabled_attribute.attr,
+        &capacity_attribute.attr,
+        &lp_bytes_attribute.attr,
+        &hp_bytes_attribute.attr,
+        &lp_threads_attribute.attr,
+        &hp_threads_attribute.attr,
+        &lp_fill_attribute.attr,
+        &hp_fill_attribute.attr,
+        &lp_borrowed_attribute.attr,
+        &hp_borrowed_attribute.attr,
+        &lp_ttl_attribute.attr,
+        &hp_ttl_attribute.attr,
+        &lp_expired_attribute.attr,
+        &hp_expired_attribute.attr,
+        &lp_reads_attribute.attr,
+        &hp_reads_attribute.attr,
+        &lp_writes_attribute.attr,
+        &hp_writes_attribute.attr,
+        &pending_bytes_attribute.attr,
+        &pending_writes_attribute.attr,
+        &lp_poll_hits_attribute.attr,
+        &hp_poll_hits_attribute.attr,
+        &lp_poll_misses_attribute.attr,
+        &hp_poll_misses_attribute.attr,
+        &pool_segments_attribute.attr,
+        &pool_tasks_attribute.attr,
+        &pool_chunks_attribute.attr,
+        &reserve_segments_attribute.attr,
+        &reserve_tasks_attribute.attr,
+        &reserve_chunks_attribute.attr,
+        &status_attribute.attr,
+        NULL,
+};
+ATTRIBUTE_GROUPS(device);
+
+/**
+ * device_kobj_release - the kobjects are embedded in the static array of devices, nothing to free
+ * @kobj:       kobject of the device
+ */
+static void device_kobj_release(struct kobject *kobj) {
+        return;
+}
+
+static struct kobj_type device_ktype = {
+        .release = device_kobj_release,
+        .sysfs_ops = &kobj_sysfs_ops,
+        .default_groups = device_groups,
+};
+
+/**
+ * init_device_attributes - creation of the sysfs directory of each device under the module directory
+ *
+ * Returns:
+ *  - 0 if all the directories are created,
+ *  - a negative value otherwise, with the release of the directories already created.
+ */
+int init_device_attributes(void) {
+        int i;
+        int res;
+
+        devices_kobj = kobject_create_and_add("devices", &(THIS_MODULE->mkobj.kobj));
+        if (devices_kobj == NULL) return -ENOMEM;
+
+        for (i = 0; i < MINOR_NUMBER; i++) {
+                res = kobject_init_and_add(&(devices[i].kobj), &device_ktype, devices_kobj, "%d", i);
+                if (res) {
+                        kobject_put(&(devices[i].kobj));
+                        for (i--; i >= 0; i--) kobject_put(&(devices[i].kobj));
+                        kobject_put(devices_kobj);
+                        return res;
+                }
+        }
+        return 0;
+}
+
+/**
+ * free_device_attributes - removal of the sysfs directory of each device
+ */
+void free_device_attributes(void) {
+        int i;
+        for (i = 0; i < MINOR_NUMBER; i++) kobject_put(&(devices[i].kobj));
+        kobject_put(devices_kobj);
+}
@@ -9,6 +9,24 @@ void init_flow_manager(flow_manager_t *flow) {
         head = &(flow->head);
         mutex_init(&(flow->op_mutex));
         init_waitqueue_head(&(flow->waitqueue));
+        init_waitqueue_head(&(flow->poll_waitqueue));
+        flow->min_read_threshold = LONG_MAX;
+        flow->min_poll_threshold = LONG_MAX;
+        init_waitqueue_head(&(flow->wr_waitqueue));
+        atomic_set(&(flow->readers_in_wait), 0);
+        atomic_long_set(&(flow->threads_in_wait), 0);
+        atomic_long_set(&(flow->poll_hits), 0);
+        atomic_long_set(&(flow->poll_misses), 0);
+        flow->bytes_in_buffer = 0;
+        flow->fill_state = FILL_LOW;
+        flow->high_watermark = flow_max_bytes;
+        flow->low_watermark = flow_max_bytes;
+        flow->throttled = false;
+        flow->borrowed = 0;
+        flow->ttl = 0;
+        flow->expired_bytes = 0;
+        flow->reads = 0;
+        flow->writes = 0;
         INIT_LIST_HEAD(head);
 }
 
@@ -30,11 +48,27 @@ void init_data_segment(data_segment_t *element, char *content, int len) {
  * @segment:    pointer to data segment to add before the specified head
  *
  * Add new data segment at the end of the list, so we build the flow as a FIFO queue.
+ * The time-to-live of the segment starts now, when it becomes readable, also for a deferred write.
  */
 void write_data_segment(flow_manager_t *flow, data_segment_t *segment) {
+        segment->timestamp = jiffies;
         list_add_tail(&(segment->entry), &(flow->head));
 }
 
+/**
+ * write_data_chain - add the chain of data segments of a write to flow, keeping their order
+ * @flow:       pointer to flow manager that handles the linked list to edit
+ * @chain:      list of data segments to add, empty at the end
+ */
+void write_data_chain(flow_manager_t *flow, struct list_head *chain) {
+        data_segment_t *segment, *tmp;
+
+        list_for_each_entry_safe(segment, tmp, chain, entry) {
+                list_del(&(segment->entry));
+                write_data_segment(flow, segment);
+        }
+}
+
 /**
  * read_from_flow - read data from flow
  * @flow:               pointer to flow manager that handles the linked list to read
@@ -57,8 +91,8 @@ void read_from_flow(flow_manager_t *flow, char *read_content, int len) {
                 byte_read += cur_seg->size - cur_seg->byte_read;
                 old = cur;
                 cur = cur->next;
-                free_data_segment(cur_seg);
                 list_del(old);
+                free_data_segment(cur_seg);
 
                 if (cur == head) break;
 
@@ -75,36 +109,309 @@ void read_from_flow(flow_manager_t *flow, char *read_content, int len) {
 }
 
 /**
- * free_data_segment - release memory of a data segment
- * @segment:    pointer to data segment to free
+ * peek_flow - read data from flow without consuming it
+ * @flow:               pointer to flow manager that handles the linked list to inspect
+ * @peek_content:       buffer that is filled with inspected data
+ * @len:                number of bytes to be inspected
+ */
+void peek_flow(flow_manager_t *flow, char *peek_content, int len) {
+        data_segment_t *cur_seg;
+        int byte_peek;
+        int to_copy;
+
+        byte_peek = 0;
+        list_for_each_entry(cur_seg, &(flow->head), entry) {
+                if (byte_peek == len) break;
+                to_copy = min(len - byte_peek, cur_seg->size - cur_seg->byte_read);
+                memcpy(peek_content + byte_peek, cur_seg->content + cur_seg->byte_read, to_copy);
+                byte_peek += to_copy;
+        }
+}
+
+/**
+ * discard_from_flow - consume data from flow without copying it
+ * @flow:       pointer to flow manager that handles the linked list to advance
+ * @len:        number of bytes to be discarded
+ *
+ * Fully consumed data segments are released, the last one is only advanced.
+ */
+void discard_from_flow(flow_manager_t *flow, int len) {
+        data_segment_t *cur_seg, *tmp;
+        int byte_discarded;
+
+        byte_discarded = 0;
+        list_for_each_entry_safe(cur_seg, tmp, &(flow->head), entry) {
+                if (len - byte_discarded < cur_seg->size - cur_seg->byte_read) {
+                        cur_seg->byte_read += len - byte_discarded;
+                        break;
+                }
+                byte_discarded += cur_seg->size - cur_seg->byte_read;
+                list_del(&(cur_seg->entry));
+                free_data_segment(cur_seg);
+                if (byte_discarded == len) break;
+        }
+}
+
+/**
+ * expire_flow - drop data segments older than the time-to-live of the flow
+ * @flow:       pointer to flow manager that handles the linked list to clean
+ *
+ * Data segments are written in FIFO order, so the oldest ones are at the head of the list.
+ *
+ * Returns the number of unread bytes dropped from the flow.
+ */
+long expire_flow(flow_manager_t *flow) {
+        data_segment_t *cur_seg, *tmp;
+        unsigned long deadline;
+        long expired;
+
+        expired = 0;
+        deadline = jiffies - msecs_to_jiffies(flow->ttl);
+        list_for_each_entry_safe(cur_seg, tmp, &(flow->head), entry) {
+                if (time_after(cur_seg->timestamp, deadline)) break;
+                expired += cur_seg->size - cur_seg->byte_read;
+                list_del(&(cur_seg->entry));
+                free_data_segment(cur_seg);
+        }
+        return expired;
+}
+
+/**
+ * reserve_space - charge new bytes in buffer to a flow
+ * @flow:       pointer to flow manager of the flow to charge
+ * @used:       bytes in buffer of the flow before the charge
+ * @len:        number of bytes to be charged
+ *
+ * Each flow can always use flow_min_bytes, beyond that it borrows from the module-wide shared budget
+ * the capacity left unused by the other flows, up to flow_max_bytes.
+ * It must be called with the op_mutex of the flow held.
+ *
+ * Returns the number of bytes granted, that can be less than @len (even 0) when the budget is exhausted.
+ */
+long reserve_space(flow_manager_t *flow, long used, long len) {
+        long needed;
+        long cur;
+        long available;
+
+        if (len > flow_max_bytes - used) len = flow_max_bytes - used;
+        if (len <= 0) return 0;
+
+        // bytes to borrow beyond the per-flow minimum, taken from the shared budget without locks
+        needed = get_borrowed(used + len) - flow->borrowed;
+        if (needed > 0) {
+                do {
+                        cur = atomic_long_read(&shared_bytes);
+                        available = shared_size() - cur;
+                        if (available <= 0) {
+                                available = 0;
+                                break;
+                        }
+                        if (available > needed) available = needed;
+                } while (atomic_long_cmpxchg(&shared_bytes, cur, cur + available) != cur);
+                flow->borrowed += available;
+                len -= needed - available;
+        }
+        return len;
+}
+
+/**
+ * grantable_space - estimate of the bytes that reserve_space can grant to a flow
+ * @used:       bytes in buffer of the flow
+ *
+ * It can be called without the op_mutex of the flow, to size the allocations of a write before taking
+ * the token: the estimate can be stale, reserve_space decides the bytes actually granted.
+ */
+long grantable_space(long used) {
+        long borrowable = shared_size() - atomic_long_read(&shared_bytes);
+        long limit = max(used, flow_min_bytes) + max(borrowable, 0L);
+
+        if (limit > flow_max_bytes) limit = flow_max_bytes;
+        return limit > used ? limit - used : 0;
+}
+
+/**
+ * release_space - give back to the shared budget the bytes borrowed by a flow that are no more in buffer
+ * @flow:       pointer to flow manager of the flow to uncharge
+ * @used:       bytes in buffer of the flow after the release
+ *
+ * Blocking writers waiting for the budget, on any flow, are awakened.
+ * It must be called with the op_mutex of the flow held.
+ */
+void release_space(flow_manager_t *flow, long used) {
+        long released = flow->borrowed - get_borrowed(used);
+        if (released <= 0) return;
+        flow->borrowed -= released;
+        atomic_long_sub(released, &shared_bytes);
+        if (wq_has_sleeper(&budget_waitqueue)) wake_up_interruptible_all(&budget_waitqueue);
+}
+
+/**
+ * alloc_data_segment - allocation of a data segment and of its content from the reserved pools of the device
+ * @device:     device manager with the pools
+ * @len:        size of the content
+ * @flags:      allocation flags of the session
+ *
+ * The header comes from the pool of data segments. The content of a non-blocking write comes from the
+ * pool of chunks, so len must not exceed POOL_CHUNK_SIZE; the content of a blocking write is allocated
+ * with kvmalloc, so large writes do not need contiguous pages, and charged to the memory cgroup of the
+ * writer. A non-blocking write first reuses a data segment of the free list of the device, still with its
+ * chunk, so the steady state never reaches the allocator. Otherwise, when the slab allocation fails,
+ * mempool_alloc falls back on the reserved elements, so a non-blocking write fails only if the reserve
+ * is exhausted too. The header of a blocking write comes straight from the slab cache, with direct reclaim:
+ * the reserve is left to the non-blocking writes, which cannot wait for memory.
+ *
+ * Returns the data segment, or NULL if the allocation failed.
+ */
+data_segment_t *alloc_data_segment(device_manager_t *device, size_t len, gfp_t flags) {
+        data_segment_t *segment = NULL;
+
+        if (is_blocking(flags)) {
+                segment = kmem_cache_alloc(segment_cache, flags);
+                if (segment == NULL) return NULL;
+                segment->device = device;
+                segment->pooled = false;
+                segment->content = kvmalloc(len, flags | __GFP_ACCOUNT);
+                if (segment->content == NULL) {
+                        kmem_cache_free(segment_cache, segment);
+                        return NULL;
+                }
+                return segment;
+        }
+
+        spin_lock(&(device->free_lock));
+        segment = list_first_entry_or_null(&(device->free_segments), data_segment_t, entry);
+        if (segment) {
+                list_del(&(segment->entry));
+                device->nr_free_segments--;
+        }
+        spin_unlock(&(device->free_lock));
+        if (segment == NULL) {
+                segment = mempool_alloc(device->segment_pool, flags);
+                if (segment == NULL) return NULL;
+                segment->device = device;
+                segment->pooled = true;
+                segment->content = mempool_alloc(device->chunk_pool, flags);
+                if (segment->content == NULL) {
+                        mempool_free(segment, device->segment_pool);
+                        return NULL;
+                }
+        }
+        atomic_inc(&(device->segments_in_use));
+        atomic_inc(&(device->chunks_in_use));
+        return segment;
+}
+
+/**
+ * free_data_segment - release memory of a data segment, back to the pools it was allocated from
+ * @segment:    pointer to data segment to free, not linked to any list
+ *
+ * A pooled data segment is kept with its chunk in the free list of the device, unless the list is full
+ * or the reserve of the pools has to be refilled first.
  */
 void free_data_segment(data_segment_t *segment) {
-        kfree(segment->content);
-        kfree(segment);
+        device_manager_t *device = segment->device;
+
+        if (!segment->pooled) {
+                kvfree(segment->content);
+                kmem_cache_free(segment_cache, segment);
+                return;
+        }
+        atomic_dec(&(device->segments_in_use));
+        atomic_dec(&(device->chunks_in_use));
+        if (pool_is_full(device->segment_pool) && pool_is_full(device->chunk_pool)) {
+                spin_lock(&(device->free_lock));
+                if (device->nr_free_segments < FREE_LIST_LENGTH) {
+                        list_add(&(segment->entry), &(device->free_segments));
+                        device->nr_free_segments++;
+                        segment = NULL;
+                }
+                spin_unlock(&(device->free_lock));
+                if (segment == NULL) return;
+        }
+        mempool_free(segment->content, device->chunk_pool);
+        mempool_free(segment, device->segment_pool);
         return;
 }
 
 /**
- * free_flow - release memory of the flow
- * @flow:     pointer to flow manager that handle the buffer to free
+ * fill_data_chain - allocation of the data segments of a write, filled with the data of the user
+ * @device:     device manager with the pools
+ * @chain:      empty list that is filled with the data segments, in order
+ * @buff:       user buffer with the data to write
+ * @len:        number of bytes to write
+ * @flags:      allocation flags of the session
+ *
+ * A blocking write is held by a single data segment. A non-blocking write is split in a chain of data
+ * segments of at most POOL_CHUNK_SIZE bytes, each with its own chunk of the pool, so the size of the
+ * write does not depend on the size of a chunk. The copy stops at the first byte that cannot be read,
+ * or at the first data segment that cannot be allocated: the chain holds the bytes covered until then.
+ * On error the data segments already in the chain are left to free_data_chain.
+ *
+ * Returns the number of bytes copied, or -ENOMEM (-EAGAIN for a non-blocking write) if not even the first
+ * data segment could be allocated.
  */
-void free_flow(flow_manager_t *flow) {
-        struct list_head *cur;
-        struct list_head *old;
-        struct list_head *head;
-        data_segment_t *cur_seg;
+long fill_data_chain(device_manager_t *device, struct list_head *chain, const char __user *buff, size_t len, gfp_t flags) {
+        data_segment_t *segment;
+        size_t size;
+        size_t not_copied;
+        size_t copied = 0;
 
-        head = &(flow->head);
-        old = NULL;
+        while (copied < len) {
+                size = is_blocking(flags) ? len : min_t(size_t, len - copied, POOL_CHUNK_SIZE);
+                segment = alloc_data_segment(device, size, flags);
+                if (segment == NULL) {
+                        if (copied > 0) break;
+                        return is_blocking(flags) ? -ENOMEM : -EAGAIN;
+                }
+                list_add_tail(&(segment->entry), chain);
 
-        list_for_each(cur, head) {
-                if (old) list_del(old);
-                cur_seg = list_entry(cur, data_segment_t, entry);
-                free_data_segment(cur_seg);
-                old = cur;
+                // from user to kernel space returns # of bytes that could not be copied
+                not_copied = copy_from_user(segment->content, buff + copied, size);
+                init_data_segment(segment, segment->content, size - not_copied);
+                copied += size - not_copied;
+                if (not_copied) break;
+        }
+        return copied;
+}
+
+/**
+ * trim_data_chain - cut the chain of data segments of a write to the bytes granted to it
+ * @chain:      list of data segments of the write
+ * @len:        number of bytes to keep
+ */
+void trim_data_chain(struct list_head *chain, long len) {
+        data_segment_t *segment, *tmp;
+
+        list_for_each_entry_safe(segment, tmp, chain, entry) {
+                if (len <= 0) {
+                        list_del(&(segment->entry));
+                        free_data_segment(segment);
+                        continue;
+                }
+                if (segment->size > len) segment->size = len;
+                len -= segment->size;
+        }
+}
+
+/**
+ * free_data_chain - release memory of a list of data segments
+ * @chain:      list of data segments, empty at the end
+ */
+void free_data_chain(struct list_head *chain) {
+        data_segment_t *segment, *tmp;
+
+        list_for_each_entry_safe(segment, tmp, chain, entry) {
+                list_del(&(segment->entry));
+                free_data_segment(segment);
         }
+}
 
+/**
+ * free_flow - release memory of the data segments in the flow, the manager is embedded in its device
+ * @flow:     pointer to flow manager that handle the buffer to free
+ */
+void free_flow(flow_manager_t *flow) {
+        free_data_chain(&(flow->head));
         mutex_destroy(&(flow->op_mutex));
-        kfree(flow);
         return;
 }
\ No newline at end of file
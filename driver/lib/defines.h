@@ -7,6 +7,7 @@
 #include <linux/list.h>
 #include <linux/pid.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/version.h>
 #include <linux/errno.h>
 #include <linux/mutex.h>
@@ -20,28 +21,43 @@
 #include <linux/errno.h>
 #include <linux/signal.h>
 #include <linux/jiffies.h>
+#include <linux/atomic.h>
+#include <linux/kref.h>
+#include <linux/eventfd.h>
+#include <linux/spinlock.h>
+#include <linux/poll.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/cache.h>
+#include <linux/sched/clock.h>
+#include <linux/mempool.h>
+#include <linux/uaccess.h>
+#include "multi-flow-ioctl.h"
 
 /* GENERAL INFORMATION */
 #define MODNAME "MULTIFLOW DRIVER"
 #define DEVICE_NAME "multi-flow device"
 #define MINOR_NUMBER 128
-#define FLOWS 2         // number of different priority
-#define LOW_PRIORITY 0  // index of low priority
-#define HIGH_PRIORITY 1 // index of high priority
-
-/* IOCTL VALUES */
-#define TO_HIGH_PRIORITY 3
-#define TO_LOW_PRIORITY 4
-#define BLOCKING 5
-#define UNBLOCKING 6
-#define TIMEOUT 7
-#define ENABLE 8
-#define DISABLE 9
-
-/* BOUNDS */
-#define MIN_SECONDS 1                                    // minimum amount of seconds for timeout
-#define MAX_SECONDS 3600                                 // maximum amount of seconds for timeout
-#define MAX_BYTE_IN_BUFFER 32 * 4096                     // maximum number of byte in buffer: 5096 * sizeof(data_segment_t)
+
+/* BOUNDS (see also multi-flow-ioctl.h) */
+#define MEMORY_BUDGET 16 * 1024 * 1024                   // default bytes in buffer of all the flows together
+#define FLOW_MIN_BYTES 4 * 4096                          // default bytes in buffer always granted to each flow
+#define FLOW_MAX_BYTES 4 * 1024 * 1024                   // default maximum number of bytes in buffer of a single flow
+#define COMMIT_THRESHOLD 4096                            // pending bytes of deferred writes that force an early commit
+#define REAPER_PERIOD_MSECS 1000                         // period of the drop of expired data segments
+#define POOL_RESERVE 8                                   // default reserved elements of each pool of a device
+#define FREE_LIST_LENGTH 16                              // freed pooled elements of each kind kept by a device for reuse
+
+/* CACHE LAYOUT */
+// the state written by each flow has its own cache lines, unless the module is built with PACKED=1 to measure
+// the false sharing avoided by the padding (see scripts/compare_layout.bash)
+#ifdef PACKED_LAYOUT
+#define cacheline_padded
+#define cacheline_padded_var
+#else
+#define cacheline_padded ____cacheline_aligned_in_smp
+#define cacheline_padded_var __cacheline_aligned_in_smp
+#endif
 
 /* STRUCTURES DEFINITION */
 
@@ -51,25 +67,80 @@
  * @priority:   priority of session
  * @flags:      type of session, blocking or not
  * @timeout:    timeout for blocking operations
+ * @deferral:   maximum deferral in msecs of low priority writes before the commit to the flow
+ * @lowat:      minimum number of bytes that a blocking read waits for (SO_RCVLOWAT)
+ * @busy_poll:  usecs that a blocking read spins waiting for data before sleeping (SO_BUSY_POLL)
+ * @refcount:   references held by the open file and by each queued deferred write
+ * @pending:    number of deferred writes queued and not yet committed to the flow
+ * @sync_waitqueue:     waitqueue for threads that wait the commit of pending deferred writes (fsync/flush)
+ * @eventfd:    optional eventfd signalled on each commit of a deferred write
+ * @eventfd_lock:       spinlock to synchronize eventfd signal and replacement
  */
 typedef struct session {
         short priority;
         gfp_t flags;
         unsigned long timeout;
+        unsigned long deferral;
+        unsigned long lowat;
+        unsigned long busy_poll;
+        struct kref refcount;
+        atomic_t pending;
+        wait_queue_head_t sync_waitqueue;
+        struct eventfd_ctx *eventfd;
+        spinlock_t eventfd_lock;
 } session_t;
 
 /** 
  * Object that handles mutex, waitqueue and buffer of data segments related to a priority flow of a specific minor
  * flow_manager_t - Manager of a priority flow
- * @head:       head of linked list
  * @op_mutex:   mutex to synchronize operations in buffer
- * @waitqueue:  waitqueue for the specific minor
+ * @head:       head of linked list
+ * @bytes_in_buffer:    number of bytes in buffer, deferred writes not yet committed included
+ * @borrowed:   bytes in buffer beyond the per-flow minimum, charged to the shared budget
+ * @high_watermark:     bytes in buffer that throttle the writers
+ * @low_watermark:      bytes in buffer below which throttled writers are woken up
+ * @throttled:  writers are blocked until the low watermark is reached
+ * @fill_state: fill state of the flow (FILL_LOW, FILL_MID, FILL_HIGH)
+ * @ttl:        time-to-live in msecs of data segments, 0 if they never expire
+ * @expired_bytes:      number of bytes dropped from the flow because expired
+ * @reads:      number of completed reads on the flow
+ * @writes:     number of completed writes on the flow
+ * @waitqueue:  waitqueue for the blocking readers of the specific minor
+ * @poll_waitqueue:     waitqueue for poll/select on the readers side
+ * @min_read_threshold: smallest threshold among the readers parked on the waitqueue, LONG_MAX if none
+ * @min_poll_threshold: smallest low watermark among the pollers since the last wakeup, LONG_MAX if none
+ * @wr_waitqueue:       waitqueue for the writers of the specific minor
+ * @threads_in_wait:    number of threads in wait on the flow
+ * @readers_in_wait:    number of readers parked on the waitqueue
+ * @poll_hits:  number of blocking reads served by the busy-poll phase
+ * @poll_misses:        number of busy-poll phases ended without data, the reader goes to sleep
+ *
+ * Each flow starts on its own cache line, so the state of a flow never shares a line with 
+ * the state of another flow or minor: cores working on different flows do not bounce lines.
  */
 typedef struct flow_manager {
-        struct list_head head;
         struct mutex op_mutex;
+        struct list_head head;
+        long bytes_in_buffer;
+        long borrowed;
+        long high_watermark;
+        long low_watermark;
+        bool throttled;
+        int fill_state;
+        unsigned long ttl;
+        unsigned long expired_bytes;
+        unsigned long reads;
+        unsigned long writes;
         wait_queue_head_t waitqueue;
-} flow_manager_t;
+        wait_queue_head_t poll_waitqueue;
+        long min_read_threshold;
+        long min_poll_threshold;
+        wait_queue_head_t wr_waitqueue;
+        atomic_long_t threads_in_wait;
+        atomic_t readers_in_wait;
+        atomic_long_t poll_hits;
+        atomic_long_t poll_misses;
+} cacheline_padded flow_manager_t;
 
 /** 
  * Single data segment of a linked list that represents a buffer, related to a priority flow of a specific minor
@@ -78,35 +149,87 @@ typedef struct flow_manager {
  * @content:    byte content of data segment
  * @byte_read:  number of byte read up to instant t
  * @size:       size of data segment content
+ * @timestamp:  jiffies at which the data segment is committed to the flow
+ * @device:     device manager whose pools the data segment is allocated from
+ * @pooled:     the data segment and its chunk come from the pools of the device, otherwise from the slab cache and kvmalloc
  */
 typedef struct data_segment {
         struct list_head entry;
         char *content;
         int byte_read;
         int size;
+        unsigned long timestamp;
+        struct device_manager *device;
+        bool pooled;
 } data_segment_t;
 
 /** 
  * Object that handles device manager for the two priority flows and a workqueue for a specific minor
  * device_manager_t - Manager of a device file
+ * @flow:       flow managers for low and high priority, embedded on their own cache lines
+ * @enabled:    state of the device file
  * @workqueue:  pointer to workqueue for low priority flow
- * @buffer:     device manager for low and high priority
+ * @pending:    FIFO list of deferred writes not yet committed to the low priority flow
+ * @pending_bytes:      number of bytes of deferred writes not yet committed
+ * @pending_writes:     number of deferred writes not yet committed
+ * @commit_work:        delayed_work that commits the batch of deferred writes
+ * @commit_deadline:    jiffies at which the commit_work is scheduled
+ * @commit_now: the next commit takes the whole batch, requested by fsync/flush
+ * @kobj:       kobject of the sysfs directory of the device
+ * @segment_pool:       reserved pool of data segments
+ * @task_pool:  reserved pool of deferred writes
+ * @chunk_pool: reserved pool of payload chunks for non-blocking writes
+ * @segments_in_use:    number of data segments allocated from the pool
+ * @tasks_in_use:       number of deferred writes allocated from the pool
+ * @chunks_in_use:      number of payload chunks allocated from the pool
+ * @free_lock:  spinlock of the free lists
+ * @free_segments:      pooled data segments freed with their chunk, reused before the pools
+ * @free_tasks: deferred writes freed, reused before the pool
+ * @nr_free_segments:   number of data segments in the free list, at most FREE_LIST_LENGTH
+ * @nr_free_tasks:      number of deferred writes in the free list, at most FREE_LIST_LENGTH
+ *
+ * The pending list and its counters are protected by the op_mutex of the low priority flow.
  */
 typedef struct device_manager {
+        flow_manager_t flow[FLOWS];
+        bool enabled;
         struct workqueue_struct *workqueue;
-        flow_manager_t *flow[FLOWS];
-} device_manager_t;
+        struct list_head pending;
+        long pending_bytes;
+        int pending_writes;
+        struct delayed_work commit_work;
+        unsigned long commit_deadline;
+        bool commit_now;
+        struct kobject kobj;
+        mempool_t *segment_pool;
+        mempool_t *task_pool;
+        mempool_t *chunk_pool;
+        atomic_t segments_in_use;
+        atomic_t tasks_in_use;
+        atomic_t chunks_in_use;
+        spinlock_t free_lock;
+        struct list_head free_segments;
+        struct list_head free_tasks;
+        int nr_free_segments;
+        int nr_free_tasks;
+} cacheline_padded device_manager_t;
 
 /**
  * async_task_t - deffered work
- * @del_work:           delayed_work struct uses a timer to run after the specified time interval
- * @to_write:           pointer to data segment to write
+ * @entry:              list_head element to link to the pending list of the device
+ * @deadline:           jiffies within which the write must be committed to the flow
+ * @to_write:           chain of data segments to write, in order
+ * @size:               number of bytes of the chain
+ * @pooled:             allocated from the reserved pool of the device, otherwise from the slab cache
  * @session:            session to the device file
  * @minor:              minor number of the device
  */
 typedef struct async_task {
-        struct delayed_work del_work;
-        data_segment_t *to_write;
+        struct list_head entry;
+        unsigned long deadline;
+        struct list_head to_write;
+        long size;
+        bool pooled;
         session_t *session;
         int minor;
 } async_task_t;
@@ -116,11 +239,39 @@ typedef struct async_task {
 void init_flow_manager(flow_manager_t *);
 void init_data_segment(data_segment_t *, char *, int);
 void write_data_segment(flow_manager_t *, data_segment_t *);
+void write_data_chain(flow_manager_t *, struct list_head *);
 void read_from_flow(flow_manager_t *, char *, int);
+void peek_flow(flow_manager_t *, char *, int);
+void discard_from_flow(flow_manager_t *, int);
+long expire_flow(flow_manager_t *);
+long reserve_space(flow_manager_t *, long, long);
+long grantable_space(long);
+void release_space(flow_manager_t *, long);
+data_segment_t *alloc_data_segment(device_manager_t *, size_t, gfp_t);
 void free_data_segment(data_segment_t *);
+long fill_data_chain(device_manager_t *, struct list_head *, const char __user *, size_t, gfp_t);
+void trim_data_chain(struct list_head *, long);
+void free_data_chain(struct list_head *);
 void free_flow(flow_manager_t *);
 
 
+/* DEVICE ATTRIBUTES FUNCTION PROTOTYPES */
+int init_device_attributes(void);
+int snapshot_device(int, device_status_t *);
+void free_device_attributes(void);
+
+
+/* GLOBAL VARIABLES */
+extern long memory_budget;
+extern long flow_min_bytes;
+extern long flow_max_bytes;
+extern atomic_long_t shared_bytes;
+extern wait_queue_head_t budget_waitqueue;
+extern int pool_reserve;
+extern struct kmem_cache *segment_cache;
+extern device_manager_t devices[MINOR_NUMBER];
+
+
 /* MACROS DEFINITION */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
 #define get_major(session) MAJOR(session->f_inode->i_rdev)
@@ -130,23 +281,62 @@ void free_flow(flow_manager_t *);
 #define get_minor(session) MINOR(session->f_dentry->d_inode->i_rdev)
 #endif
 
-// we avoid check on priority with a simple operation using a single vector for bytes_in_buffer and threads_in_wait parameters
-// priority low = 0 --> refers to buffers/threads from 0 to 127 (buffers/threads with low priority)
-// priority high = 1 --> refers to buffers/threads from 128 to 255 (buffers/threads with high priority)
-#define get_buffer_index(priority, minor) ((priority * MINOR_NUMBER) + minor)
-#define get_thread_index(priority, minor) ((priority * MINOR_NUMBER) + minor)
-#define byte_to_read(priority, minor) bytes_in_buffer[get_buffer_index(priority, minor)]
+// eventfd_signal() lost the counter argument in 6.8, every signal adds 1 to the eventfd counter
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define signal_eventfd(ctx) eventfd_signal(ctx)
+#else
+#define signal_eventfd(ctx) eventfd_signal(ctx, 1)
+#endif
+
+// the state of a flow is reached from the device manager of the minor, where each flow has its own cache lines
+#define get_flow(priority, minor) (&(devices[minor].flow[priority]))
+// bytes reserved by deferred writes are counted in the low priority buffer but cannot be read until committed
+#define byte_to_read(priority, minor) (used_space(priority, minor) - \
+                                       (priority == LOW_PRIORITY ? devices[minor].pending_bytes : 0))
+// same count read without the op_mutex of the flow, reloaded at each use
+#define byte_to_read_once(priority, minor) (READ_ONCE(used_space(priority, minor)) - \
+                                            (priority == LOW_PRIORITY ? READ_ONCE(devices[minor].pending_bytes) : 0))
 
 #define get_seconds(sec) (sec > MAX_SECONDS ? sec = MAX_SECONDS : (sec == 0 ? sec = MIN_SECONDS : sec))
-#define used_space(priority, minor) (priority == LOW_PRIORITY ? (bytes_in_buffer[get_buffer_index(priority, minor)]) : bytes_in_buffer[get_buffer_index(priority, minor)])
-#define free_space(priority, minor) MAX_BYTE_IN_BUFFER - used_space(priority, minor)
+#define get_deferral(msec) (msec > MAX_DEFERRAL_MSECS ? MAX_DEFERRAL_MSECS : msec)
+#define get_lowat(bytes) (bytes > flow_max_bytes ? flow_max_bytes : (bytes == 0 ? 1 : bytes))
+#define get_busy_poll(usec) (usec > MAX_BUSY_POLL_USECS ? MAX_BUSY_POLL_USECS : usec)
+#define valid_watermarks(wm) (wm.low > 0 && wm.low <= wm.high && wm.high <= flow_max_bytes)
+#define get_fill_state(flow, priority, minor) ((flow)->throttled ? FILL_HIGH : \
+                                               (used_space(priority, minor) < (flow)->low_watermark ? FILL_LOW : FILL_MID))
+#define update_fill_state(flow, priority, minor) (flow)->fill_state = get_fill_state(flow, priority, minor)
+#define read_threshold(session, len) ((long)min_t(unsigned long, (session)->lowat, len))
+// readers and pollers wait each one for its own threshold, so they are all woken but only when at least one of them can complete
+#define wake_up_readers(flow, priority, minor) do {                                                             \
+        smp_mb();                                                                                               \
+        if (byte_to_read(priority, minor) >= READ_ONCE((flow)->min_read_threshold))                             \
+                wake_up_interruptible_all(&((flow)->waitqueue));                                                \
+        if (byte_to_read(priority, minor) >= READ_ONCE((flow)->min_poll_threshold))                             \
+                wake_up_pollers(flow);                                                                          \
+} while (0)
+// a single writer is woken, it passes the baton to the next one: issued after the release of the op_mutex of the flow,
+// otherwise the trylock of the woken writer fails and the exclusive wakeup is lost
+#define wake_up_writers(flow, priority, minor) do {                                                             \
+        if (wq_has_sleeper(&((flow)->wr_waitqueue)) && !READ_ONCE((flow)->throttled) &&                         \
+            READ_ONCE(used_space(priority, minor)) < READ_ONCE((flow)->high_watermark))                          \
+                wake_up_interruptible(&((flow)->wr_waitqueue));                                                 \
+} while (0)
+#define must_commit(device) (atomic_read(&((device)->flow[LOW_PRIORITY].readers_in_wait)) > 0 || \
+                             (device)->pending_bytes >= COMMIT_THRESHOLD)
+#define used_space(priority, minor) (get_flow(priority, minor)->bytes_in_buffer)
+#define free_space(priority, minor) (flow_max_bytes - used_space(priority, minor))
 #define is_free(priority, minor) (free_space(priority, minor) > 0 ? 1 : 0)
 #define is_empty(priority, minor) (byte_to_read(priority, minor) == 0 ? 1 : 0)
 #define is_blocking(flags) (flags == GFP_KERNEL ? 1 : 0)
-#define add_to_buffer(priority, minor, len) bytes_in_buffer[get_buffer_index(priority, minor)] += len
-#define sub_to_buffer(priority, minor, len) bytes_in_buffer[get_buffer_index(priority, minor)] -= len
-#define inc_thread_in_wait(priority, minor) __sync_fetch_and_add(threads_in_wait + get_thread_index(priority, minor), 1)
-#define dec_thread_in_wait(priority, minor) __sync_fetch_and_sub(threads_in_wait + get_thread_index(priority, minor), 1)
+#define shared_size() (memory_budget - FLOWS * MINOR_NUMBER * flow_min_bytes)
+#define get_borrowed(used) ((used) > flow_min_bytes ? (used) - flow_min_bytes : 0)
+// the reserve of a pool is refilled by mempool_free, so freed elements are kept aside only when it is full
+#define pool_is_full(pool) (READ_ONCE((pool)->curr_nr) >= (pool)->min_nr)
+#define budget_available(used) ((used) < flow_min_bytes || atomic_long_read(&shared_bytes) < shared_size())
+#define add_to_buffer(priority, minor, len) get_flow(priority, minor)->bytes_in_buffer += len
+#define sub_to_buffer(priority, minor, len) get_flow(priority, minor)->bytes_in_buffer -= len
+#define inc_thread_in_wait(priority, minor) atomic_long_inc(&(get_flow(priority, minor)->threads_in_wait))
+#define dec_thread_in_wait(priority, minor) atomic_long_dec(&(get_flow(priority, minor)->threads_in_wait))
 
 /**
  * This macro allow to put in waitqueue a task in exclusive mode and set a timeout.
@@ -0,0 +1,141 @@
+#ifndef MULTI_FLOW_IOCTL_H
+#define MULTI_FLOW_IOCTL_H
+
+/**
+ * ioctl interface of the multi flow device driver, shared by the driver (/driver/lib/defines.h)
+ * and by user space programs (/user/lib/defines.h): only fixed size types, so the layout is the same on both sides.
+ */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* FLOWS */
+#define FLOWS 2         // number of different priority
+#define LOW_PRIORITY 0  // index of low priority
+#define HIGH_PRIORITY 1 // index of high priority
+
+/* BOUNDS */
+#define MIN_SECONDS 1                                    // minimum amount of seconds for timeout
+#define MAX_SECONDS 3600                                 // maximum amount of seconds for timeout
+#define MAX_DEFERRAL_MSECS 5000                          // maximum (and default) deferral of low priority writes in msecs
+#define MAX_BUSY_POLL_USECS 10000                        // maximum busy-poll budget of blocking reads in usecs
+#define MAX_TTL_MSECS (MAX_SECONDS * 1000)               // maximum time-to-live of data segments in msecs
+#define POOL_CHUNK_SIZE 4096                             // bytes of each data segment of a non-blocking write, served by the reserved pools
+
+/* FILL STATES */
+#define FILL_LOW 0                                       // bytes in buffer below the low watermark
+#define FILL_MID 1                                       // bytes in buffer between the watermarks, writers not throttled
+#define FILL_HIGH 2                                      // writers throttled until the low watermark is reached
+
+/* STRUCTURES DEFINITION */
+
+/**
+ * peek_t - parameter of the MFD_IOC_PEEK ioctl
+ * @buff:       address of the user buffer that is filled with the inspected data
+ * @len:        number of bytes to be inspected
+ */
+typedef struct peek {
+        __u64 buff;
+        __u64 len;
+} peek_t;
+
+/**
+ * watermarks_t - parameter of the MFD_IOC_WATERMARKS ioctl
+ * @high:       bytes in buffer that throttle the writers
+ * @low:        bytes in buffer below which throttled writers are woken up
+ */
+typedef struct watermarks {
+        __s64 high;
+        __s64 low;
+} watermarks_t;
+
+/**
+ * session_config_t - parameter of the MFD_IOC_SET_CONFIG ioctl, full configuration of a session
+ * @priority:   LOW_PRIORITY or HIGH_PRIORITY
+ * @blocking:   1 for blocking operations, 0 for non-blocking operations
+ * @timeout:    timeout in seconds for blocking operations
+ * @deferral:   maximum deferral in msecs of low priority writes
+ * @lowat:      minimum number of bytes that a blocking read waits for
+ * @busy_poll:  busy-poll budget in usecs of blocking reads before sleeping, 0 to disable
+ * @reserved:   must be 0, kept for future fields
+ */
+typedef struct session_config {
+        __u32 priority;
+        __u32 blocking;
+        __u32 timeout;
+        __u32 deferral;
+        __u64 lowat;
+        __u32 busy_poll;
+        __u32 reserved;
+} session_config_t;
+
+/**
+ * device_status_t - parameter of the MFD_IOC_GET_STATUS ioctl, consistent snapshot of a minor
+ * @enabled:            1 if the device is enabled, 0 otherwise
+ * @pending_writes:     number of deferred writes not yet committed
+ * @pending_bytes:      number of bytes of deferred writes not yet committed
+ * @capacity:           maximum number of bytes in buffer of each flow
+ * @bytes:              number of bytes in buffer for each flow
+ * @threads:            number of threads in wait for each flow
+ * @fill:               fill state for each flow
+ * @borrowed:           bytes borrowed from the shared budget for each flow
+ * @ttl:                time-to-live in msecs of data segments for each flow
+ * @expired:            number of expired bytes for each flow
+ * @reads:              number of completed reads for each flow
+ * @writes:             number of completed writes for each flow
+ * @poll_hits:          number of blocking reads served by the busy-poll phase for each flow
+ * @poll_misses:        number of busy-poll phases ended without data for each flow
+ * @pool_segments:      number of data segments in use from the reserved pool of the device
+ * @pool_tasks:         number of deferred writes in use from the reserved pool of the device
+ * @pool_chunks:        number of payload chunks in use from the reserved pool of the device
+ * @reserve_segments:   number of reserved data segments still available
+ * @reserve_tasks:      number of reserved deferred writes still available
+ * @reserve_chunks:     number of reserved payload chunks still available
+ */
+typedef struct device_status {
+        __u32 enabled;
+        __u32 pending_writes;
+        __s64 pending_bytes;
+        __s64 capacity;
+        __s64 bytes[FLOWS];
+        __s64 threads[FLOWS];
+        __u32 fill[FLOWS];
+        __s64 borrowed[FLOWS];
+        __u64 ttl[FLOWS];
+        __u64 expired[FLOWS];
+        __u64 reads[FLOWS];
+        __u64 writes[FLOWS];
+        __u64 poll_hits[FLOWS];
+        __u64 poll_misses[FLOWS];
+        __u32 pool_segments;
+        __u32 pool_tasks;
+        __u32 pool_chunks;
+        __u32 reserve_segments;
+        __u32 reserve_tasks;
+        __u32 reserve_chunks;
+} device_status_t;
+
+/* IOCTL COMMANDS */
+#define MFD_IOC_MAGIC 'm'
+
+// commands with a value as parameter, or without parameter
+#define MFD_IOC_HIGH_PRIORITY   _IO(MFD_IOC_MAGIC, 1)
+#define MFD_IOC_LOW_PRIORITY    _IO(MFD_IOC_MAGIC, 2)
+#define MFD_IOC_BLOCKING        _IO(MFD_IOC_MAGIC, 3)
+#define MFD_IOC_UNBLOCKING      _IO(MFD_IOC_MAGIC, 4)
+#define MFD_IOC_TIMEOUT         _IO(MFD_IOC_MAGIC, 5)   // seconds
+#define MFD_IOC_ENABLE          _IO(MFD_IOC_MAGIC, 6)
+#define MFD_IOC_DISABLE         _IO(MFD_IOC_MAGIC, 7)
+#define MFD_IOC_EVENTFD         _IO(MFD_IOC_MAGIC, 8)   // eventfd descriptor, negative to unregister
+#define MFD_IOC_DEFERRAL        _IO(MFD_IOC_MAGIC, 9)   // msecs
+#define MFD_IOC_DISCARD         _IO(MFD_IOC_MAGIC, 10)  // bytes
+#define MFD_IOC_LOWAT           _IO(MFD_IOC_MAGIC, 11)  // bytes
+#define MFD_IOC_TTL             _IO(MFD_IOC_MAGIC, 12)  // msecs, 0 to disable
+#define MFD_IOC_BUSY_POLL       _IO(MFD_IOC_MAGIC, 17)  // usecs, 0 to disable
+
+// commands with a structure as parameter
+#define MFD_IOC_PEEK            _IOW(MFD_IOC_MAGIC, 13, peek_t)
+#define MFD_IOC_WATERMARKS      _IOW(MFD_IOC_MAGIC, 14, watermarks_t)
+#define MFD_IOC_SET_CONFIG      _IOW(MFD_IOC_MAGIC, 15, session_config_t)
+#define MFD_IOC_GET_STATUS      _IOR(MFD_IOC_MAGIC, 16, device_status_t)
+
+#endif
@@ -9,22 +9,127 @@
 #include "lib/defines.h"
 
 /* Module parameters */
-bool enabled[MINOR_NUMBER] = {[0 ... (MINOR_NUMBER-1)] = true};                          //state of the device files
-long bytes_in_buffer[FLOWS * MINOR_NUMBER];                                              //#bytes in flow for every minor
-long threads_in_wait[FLOWS * MINOR_NUMBER];                                              //#threads in wait on flow for every minor
+long memory_budget = MEMORY_BUDGET;                                                      //bytes in buffer of all the flows
+long flow_min_bytes = FLOW_MIN_BYTES;                                                    //bytes in buffer granted to each flow
+long flow_max_bytes = FLOW_MAX_BYTES;                                                    //bytes in buffer of a single flow
+int pool_reserve = POOL_RESERVE;                                                         //reserved elements of each pool of a device
+// updated by the writes and reads of any flow beyond flow_min_bytes, so it does not share a cache line with the read-mostly limits
+atomic_long_t shared_bytes cacheline_padded_var = ATOMIC_LONG_INIT(0);                   //bytes borrowed from the shared budget
+
+/**
+ * get_enabled - value of the enabled parameter, state of the device files separated by commas
+ */
+static int get_enabled(char *buffer, const struct kernel_param *kp) {
+        int i;
+        int len = 0;
+        for (i = 0; i < MINOR_NUMBER; i++)
+                len += scnprintf(buffer + len, PAGE_SIZE - len, "%c%c", devices[i].enabled ? 'Y' : 'N', i < MINOR_NUMBER - 1 ? ',' : '\n');
+        return len;
+}
+
+/**
+ * set_enabled - update of the state of the device files from a list of values separated by commas
+ *
+ * The whole list is parsed before any device is updated, so an invalid value leaves all the states unchanged.
+ */
+static int set_enabled(const char *val, const struct kernel_param *kp) {
+        bool values[MINOR_NUMBER];
+        char *list, *cur, *token;
+        int i = 0;
+        int res = 0;
+
+        list = kstrdup(val, GFP_KERNEL);
+        if (list == NULL) return -ENOMEM;
+        cur = strim(list);
+        while ((token = strsep(&cur, ",")) != NULL) {
+                if (i == MINOR_NUMBER || kstrtobool(token, values + i)) {
+                        res = -EINVAL;
+                        break;
+                }
+                i++;
+        }
+        kfree(list);
+        if (res) return res;
+        while (i-- > 0) devices[i].enabled = values[i];
+        return 0;
+}
+
+/**
+ * flow_param - read-only parameter with a value for each flow of every minor
+ * @name:       name of the parameter
+ * @expr:       value of the flow, it can refer to the flow manager
+ *
+ * Values are listed from the low priority flows (minors 0 to 127) to the high priority flows (minors 0 to 127),
+ * as in the arrays of the previous versions of the driver.
+ */
+#define flow_param(name, expr)                                                                                  \
+static int get_##name##_param(char *buffer, const struct kernel_param *kp) {                                    \
+        flow_manager_t *flow;                                                                                   \
+        int i;                                                                                                  \
+        int len = 0;                                                                                            \
+        for (i = 0; i < FLOWS * MINOR_NUMBER; i++) {                                                            \
+                flow = &(devices[i % MINOR_NUMBER].flow[i / MINOR_NUMBER]);                                     \
+                len += scnprintf(buffer + len, PAGE_SIZE - len, "%ld%c", (long)(expr),                          \
+                                 i < FLOWS * MINOR_NUMBER - 1 ? ',' : '\n');                                    \
+        }                                                                                                       \
+        return len;                                                                                             \
+}                                                                                                               \
+static const struct kernel_param_ops name##_ops = {                                                             \
+        .get = get_##name##_param,                                                                              \
+};                                                                                                              \
+module_param_cb(name, &name##_ops, NULL, S_IRUSR | S_IRGRP)
+
+static const struct kernel_param_ops enabled_ops = {
+        .set = set_enabled,
+        .get = get_enabled,
+};
 
 // only device enabling state can be modified, so we enable write permission
-module_param_array(enabled, bool, NULL, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+module_param_cb(enabled, &enabled_ops, NULL, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 MODULE_PARM_DESC(enabled_device, "Module parameter implemented in order to enable or disable a device with a specific \
 minor number. If it is disabled, any attempt to open a session should fail, except for already opened sessions.");
-module_param_array(bytes_in_buffer, long, NULL, S_IRUSR | S_IRGRP);
+// the state of the flows lives in the device managers, the parameters are views over it
+flow_param(bytes_in_buffer, flow->bytes_in_buffer);
 MODULE_PARM_DESC(hp_bytes, "Number of bytes currently present in low and high priority flows.");
-module_param_array(threads_in_wait, long, NULL, S_IRUSR | S_IRGRP);
+flow_param(threads_in_wait, atomic_long_read(&(flow->threads_in_wait)));
 MODULE_PARM_DESC(hp_threads, "Number of threads currently in wait on low and high priority flows.");
+flow_param(fill_state, flow->fill_state);
+MODULE_PARM_DESC(fill_state, "Fill state of low and high priority flows: 0 below low watermark, 1 between watermarks, \
+2 writers throttled until the low watermark.");
+
+// memory budget can be set only when the module is loaded
+module_param(memory_budget, long, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(memory_budget, "Maximum number of bytes in buffer of all the flows together.");
+module_param(flow_min_bytes, long, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(flow_min_bytes, "Number of bytes in buffer always granted to each flow, beyond that a flow borrows \
+from the capacity of the budget left unused by the other flows.");
+module_param(flow_max_bytes, long, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(flow_max_bytes, "Maximum number of bytes in buffer of a single flow.");
+module_param(pool_reserve, int, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(pool_reserve, "Number of data segments, deferred writes and payload chunks reserved for each device, \
+so that non-blocking writes do not fail under memory pressure.");
+
+/**
+ * get_shared_bytes - value of the shared_bytes parameter
+ */
+static int get_shared_bytes(char *buffer, const struct kernel_param *kp) {
+        return scnprintf(buffer, PAGE_SIZE, "%ld\n", atomic_long_read(&shared_bytes));
+}
+
+static const struct kernel_param_ops shared_bytes_ops = {
+        .get = get_shared_bytes,
+};
+module_param_cb(shared_bytes, &shared_bytes_ops, NULL, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(shared_bytes, "Number of bytes currently borrowed by the flows from the shared budget.");
 
 /* Global variables */
 static int major;
-device_manager_t devices[MINOR_NUMBER];
+static bool unloading;
+DECLARE_WAIT_QUEUE_HEAD(budget_waitqueue);
+struct kmem_cache *segment_cache;
+static struct kmem_cache *task_cache;
+static struct kmem_cache *chunk_cache;
+device_manager_t devices[MINOR_NUMBER] = {[0 ... (MINOR_NUMBER-1)] = {.enabled = true}};
 
 /* Function prototypes */
 int init_module(void);
@@ -34,8 +139,33 @@ static int device_release(struct inode *, struct file *);
 static ssize_t device_ioctl(struct file *, unsigned int, unsigned long);
 static ssize_t device_read(struct file *, char *, size_t, loff_t *);
 static ssize_t device_write(struct file *, const char *, size_t, loff_t *);
-int init_operation(flow_manager_t *, session_t *, int, char *);
-void async_write(struct delayed_work *);
+static __poll_t device_poll(struct file *, poll_table *);
+static int device_flush(struct file *, fl_owner_t);
+static int device_fsync(struct file *, loff_t, loff_t, int);
+static ssize_t device_peek(struct file *, char *, size_t);
+static ssize_t device_discard(struct file *, size_t);
+int init_operation(flow_manager_t *, session_t *, int, char *, size_t);
+int busy_poll_flow(flow_manager_t *, session_t *, int, size_t);
+void enter_read_wait(flow_manager_t *, long);
+void exit_read_wait(flow_manager_t *);
+void wake_up_pollers(flow_manager_t *);
+int can_write(flow_manager_t *, short, int);
+long readable_bytes(flow_manager_t *, short, int);
+void expire_segments(flow_manager_t *, short, int);
+void reap_segments(struct work_struct *);
+void update_writers(flow_manager_t *, short, int);
+int sync_session(session_t *, int, bool);
+void release_session(struct kref *);
+void schedule_commit(device_manager_t *, unsigned long);
+void async_write(struct work_struct *);
+async_task_t *alloc_async_task(device_manager_t *, gfp_t);
+void free_async_task(device_manager_t *, async_task_t *);
+int init_device_pools(device_manager_t *);
+void free_device_pools(device_manager_t *);
+void free_pool_caches(void);
+
+// periodic drop of expired data segments of the flows with a time-to-live
+static DECLARE_DELAYED_WORK(reaper_work, reap_segments);
 
 /* Driver operations
 *  Each field corresponds to the address of some function defined by the driver to handle a requested operation:
@@ -44,6 +174,9 @@ void async_write(struct delayed_work *);
         - manage I/O control requests for a minor
         - write for a minor
         - read for a minor
+        - poll/select readiness for a minor
+        - flush of deferred writes when a session is closed
+        - fsync of deferred writes for a minor
 */
 static struct file_operations fops = {
         .owner = THIS_MODULE,
@@ -51,7 +184,10 @@ static struct file_operations fops = {
         .release = device_release,
         .unlocked_ioctl = device_ioctl,
         .write = device_write,
-        .read = device_read
+        .read = device_read,
+        .poll = device_poll,
+        .flush = device_flush,
+        .fsync = device_fsync
 };
 
 
@@ -64,7 +200,7 @@ static int device_open(struct inode *inode, struct file *filp) {
         session_t *session;
         int minor = get_minor(filp);
         if (minor < 0 && minor >= MINOR_NUMBER) return -ENODEV;
-        if (!enabled[minor]) return -EBUSY;
+        if (!devices[minor].enabled) return -EBUSY;
         session = kmalloc(sizeof(session_t), GFP_KERNEL);
         if (session == NULL) {
                 pr_info("Failure on session_t allocation\n");
@@ -73,6 +209,14 @@ static int device_open(struct inode *inode, struct file *filp) {
         session->priority = HIGH_PRIORITY;
         session->flags = GFP_KERNEL;
         session->timeout = MAX_SECONDS;
+        session->deferral = MAX_DEFERRAL_MSECS;
+        session->lowat = 1;
+        session->busy_poll = 0;
+        session->eventfd = NULL;
+        spin_lock_init(&(session->eventfd_lock));
+        kref_init(&(session->refcount));
+        atomic_set(&(session->pending), 0);
+        init_waitqueue_head(&(session->sync_waitqueue));
         filp->private_data = session;
         pr_info("Session opened for minor: %d\n", minor);
         return 0;
@@ -85,51 +229,196 @@ static int device_open(struct inode *inode, struct file *filp) {
  */
 static int device_release(struct inode *inode, struct file *filp) {
         int minor = get_minor(filp);
-        kfree(filp->private_data);
+        session_t *session = (session_t *)filp->private_data;
+        // deferred writes still queued keep their own reference, the last one releases the session
+        kref_put(&(session->refcount), release_session);
         filp->private_data = NULL;
         pr_info("Session closed for minor: %d\n", minor);
         return 0;
 }
 
+/**
+ * release_session - release memory of a session when its last reference is dropped
+ * @ref:        pointer to the refcount of the session to free
+ */
+void release_session(struct kref *ref) {
+        session_t *session = container_of(ref, session_t, refcount);
+        if (session->eventfd) eventfd_ctx_put(session->eventfd);
+        kfree(session);
+}
+
+/**
+ * sync_session - commit the deferred writes queued by a session without waiting their deadlines
+ * @session:    I/O session to the device file
+ * @minor:      minor number of the device file
+ * @wait:       wait until the deferred writes of the session are in the flow
+ *
+ * The batch is FIFO, so the whole pending batch of the device is committed at once.
+ *
+ * Returns:
+ *  - 0 when there are no more pending deferred writes for the session (or without wait),
+ *  - -EINTR if the wait was interrupted by a signal.
+ */
+int sync_session(session_t *session, int minor, bool wait) {
+        device_manager_t *device = devices + minor;
+
+        if (atomic_read(&(session->pending)) == 0) return 0;
+        mutex_lock(&(device->flow[LOW_PRIORITY].op_mutex));
+        if (device->pending_writes > 0) {
+                device->commit_now = true;
+                schedule_commit(device, jiffies);
+        }
+        mutex_unlock(&(device->flow[LOW_PRIORITY].op_mutex));
+        if (!wait) return 0;
+
+        pr_info("Thread waits for %d pending deferred writes...\n", atomic_read(&(session->pending)));
+        if (wait_event_interruptible(session->sync_waitqueue, atomic_read(&(session->pending)) == 0)) return -EINTR;
+        return 0;
+}
+
+/**
+ * device_flush - commit of deferred writes when a session to a minor is closed
+ * @filp:       I/O session to the device file
+ * @id:         owner of the file table [not useful]
+ *
+ * The commit is brought forward for every session, but only a blocking session waits for it:
+ * close() of a non-blocking session never blocks, its deferred writes keep the session alive.
+ */
+static int device_flush(struct file *filp, fl_owner_t id) {
+        session_t *session = (session_t *)filp->private_data;
+        pr_info("Flush operation called for minor: %d\n", get_minor(filp));
+        return sync_session(session, get_minor(filp), is_blocking(session->flags));
+}
+
+/**
+ * device_fsync - commit of deferred writes for a minor
+ * @filp:       I/O session to the device file
+ * @start:      start of the range to sync [not useful]
+ * @end:        end of the range to sync [not useful]
+ * @datasync:   sync only data and not metadata [not useful]
+ */
+static int device_fsync(struct file *filp, loff_t start, loff_t end, int datasync) {
+        pr_info("Fsync operation called for minor: %d\n", get_minor(filp));
+        return sync_session((session_t *)filp->private_data, get_minor(filp), true);
+}
+
 /**
  * device_ioctl - manager of I/O control requests 
  * @filp:       I/O session to the device file
  * @command:    requested ioctl command
- * @param:      optional parameter (timeout)
+ * @param:      optional parameter (timeout, eventfd descriptor, deferral, bytes to discard, low watermark, 
+ *              time-to-live) or address of the structure of the command (see multi-flow-ioctl.h)
  */
 static ssize_t device_ioctl(struct file *filp, unsigned int command, unsigned long param) {
         session_t *session = (session_t *)filp->private_data;
+        struct eventfd_ctx *ctx;
+        flow_manager_t *flow;
+        watermarks_t watermarks;
+        session_config_t config;
+        device_status_t status;
+        peek_t peek;
+        int res;
         int minor = get_minor(filp);
         switch (command) {
-        case TO_HIGH_PRIORITY:
+        case MFD_IOC_HIGH_PRIORITY:
                 session->priority = HIGH_PRIORITY;
                 pr_info("Switched to high priority for minor: %d\n", minor);
                 break;
-        case TO_LOW_PRIORITY:
+        case MFD_IOC_LOW_PRIORITY:
                 session->priority = LOW_PRIORITY;
                 pr_info("Switched to low priority for minor: %d\n", minor);
                 break;
-        case BLOCKING:
+        case MFD_IOC_BLOCKING:
                 session->flags = GFP_KERNEL;
                 pr_info("Switched to blocking operations for minor: %d\n", minor);
                 break;
-        case UNBLOCKING:
+        case MFD_IOC_UNBLOCKING:
                 session->flags = GFP_ATOMIC;
                 pr_info("Switched to unblocking operations for minor: %d\n", minor);
                 break;
-        case TIMEOUT:
+        case MFD_IOC_TIMEOUT:
                 session->flags = GFP_KERNEL;
                 session->timeout = get_seconds(param);
                 pr_info("Setup of timeout for blocking operations to %ld sec for minor: %d\n", session->timeout, minor);
                 break;
-        case ENABLE:
-                enabled[minor] = true;
+        case MFD_IOC_ENABLE:
+                devices[minor].enabled = true;
                 pr_info("Device with minor: %d has been enabled\n", minor);
                 break;
-        case DISABLE:
-                enabled[minor] = false;
+        case MFD_IOC_DISABLE:
+                devices[minor].enabled = false;
                 pr_info("Device with minor: %d has been disabled\n", minor);
                 break;
+        case MFD_IOC_EVENTFD:
+                // a negative descriptor unregisters the eventfd of the session
+                ctx = NULL;
+                if ((int)param >= 0) {
+                        ctx = eventfd_ctx_fdget((int)param);
+                        if (IS_ERR(ctx)) return PTR_ERR(ctx);
+                }
+                spin_lock(&(session->eventfd_lock));
+                swap(session->eventfd, ctx);
+                spin_unlock(&(session->eventfd_lock));
+                if (ctx) eventfd_ctx_put(ctx);
+                pr_info("Setup of eventfd for deferred writes completion for minor: %d\n", minor);
+                break;
+        case MFD_IOC_DEFERRAL:
+                session->deferral = get_deferral(param);
+                pr_info("Setup of deferral for low priority writes to %ld msec for minor: %d\n", session->deferral, minor);
+                break;
+        case MFD_IOC_PEEK:
+                if (copy_from_user(&peek, (peek_t __user *)param, sizeof(peek_t))) return -EFAULT;
+                return device_peek(filp, u64_to_user_ptr(peek.buff), peek.len);
+        case MFD_IOC_DISCARD:
+                return device_discard(filp, param);
+        case MFD_IOC_LOWAT:
+                session->lowat = get_lowat(param);
+                pr_info("Setup of low watermark for blocking reads to %ld bytes for minor: %d\n", session->lowat, minor);
+                break;
+        case MFD_IOC_BUSY_POLL:
+                session->busy_poll = get_busy_poll(param);
+                pr_info("Setup of busy-poll budget for blocking reads to %ld usec for minor: %d\n", session->busy_poll, minor);
+                break;
+        case MFD_IOC_WATERMARKS:
+                if (copy_from_user(&watermarks, (watermarks_t __user *)param, sizeof(watermarks_t))) return -EFAULT;
+                if (!valid_watermarks(watermarks)) return -EINVAL;
+                flow = &(devices[minor].flow[session->priority]);
+                mutex_lock(&(flow->op_mutex));
+                flow->high_watermark = watermarks.high;
+                flow->low_watermark = watermarks.low;
+                update_writers(flow, session->priority, minor);
+                mutex_unlock(&(flow->op_mutex));
+                wake_up_writers(flow, session->priority, minor);
+                pr_info("Setup of writer watermarks to %lld/%lld bytes for minor: %d\n", watermarks.high, watermarks.low, minor);
+                break;
+        case MFD_IOC_TTL:
+                if (param > MAX_TTL_MSECS) return -EINVAL;
+                flow = &(devices[minor].flow[session->priority]);
+                mutex_lock(&(flow->op_mutex));
+                flow->ttl = param;
+                expire_segments(flow, session->priority, minor);
+                mutex_unlock(&(flow->op_mutex));
+                wake_up_writers(flow, session->priority, minor);
+                pr_info("Setup of time-to-live of data segments to %lu msec for minor: %d\n", param, minor);
+                break;
+        case MFD_IOC_SET_CONFIG:
+                // the whole configuration is validated before applying it to the session
+                if (copy_from_user(&config, (session_config_t __user *)param, sizeof(session_config_t))) return -EFAULT;
+                if (config.priority != LOW_PRIORITY && config.priority != HIGH_PRIORITY) return -EINVAL;
+                if (config.reserved) return -EINVAL;
+                session->priority = config.priority;
+                session->flags = config.blocking ? GFP_KERNEL : GFP_ATOMIC;
+                session->timeout = get_seconds(config.timeout);
+                session->deferral = get_deferral(config.deferral);
+                session->lowat = get_lowat(config.lowat);
+                session->busy_poll = get_busy_poll(config.busy_poll);
+                pr_info("Setup of session configuration for minor: %d\n", minor);
+                break;
+        case MFD_IOC_GET_STATUS:
+                res = snapshot_device(minor, &status);
+                if (res) return res;
+                if (copy_to_user((device_status_t __user *)param, &status, sizeof(device_status_t))) return -EFAULT;
+                break;
         default:
                 return -ENOTTY;
         }
@@ -149,94 +438,130 @@ static ssize_t device_ioctl(struct file *filp, unsigned int command, unsigned lo
  */
 static ssize_t device_write(struct file *filp, const char *buff, size_t len, loff_t *off) {
         int res;
-        int byte_not_copied;
         int minor;
-        char *tmp_buf;
+        long copied;
+        long granted;
+        short priority;
         device_manager_t *device;
         session_t *session;
         flow_manager_t *flow;
-        data_segment_t *to_write;
         async_task_t *task;
+        LIST_HEAD(to_write);
 
         // retrieve the obj related to the minor and the manager related to the priority of the session
         minor = get_minor(filp);
         device = devices + minor;
         session = (session_t *)filp->private_data;
-        flow = device->flow[session->priority];
+        priority = session->priority;
+        flow = &(device->flow[priority]);
         task = NULL;
 
-        pr_info("Write operation called for minor: %d\n", minor);
+        pr_debug("Write operation called for minor: %d\n", minor);
         if (len <= 0) return 0;
 
-        // copy data to write on a temp buffer, from user to kernel space returns # of bytes that colud not be copied
-        tmp_buf = kmalloc(len, session->flags);
-        if (tmp_buf == NULL) {
-                pr_info("Failure on char* allocation\n");
-                return -1;
+        // prepare memory areas from the reserved pools of the device, non-blocking writes are served by a chain of chunks
+        // memory of the flows is charged to the memory cgroup of the writer
+        if (len > flow_max_bytes) len = flow_max_bytes;
+        // a non-blocking write allocates chunks only for the space the flow can be granted now (at least one chunk,
+        // the token decides), a blocking write may wait for more space so it keeps the whole request
+        if (!is_blocking(session->flags))
+                len = min_t(size_t, len, max_t(long, grantable_space(READ_ONCE(used_space(priority, minor))), POOL_CHUNK_SIZE));
+        copied = fill_data_chain(device, &to_write, buff, len, session->flags);
+        if (copied <= 0) {
+                pr_info("Failure on data_segment_t allocation or copy\n");
+                free_data_chain(&to_write);
+                return copied < 0 ? copied : -EFAULT;
         }
-        byte_not_copied = copy_from_user(tmp_buf, buff, len);
 
-        // prepare memory areas
-        to_write = kmalloc(sizeof(data_segment_t), session->flags);
-        if (to_write == NULL) {
-                pr_info("Failure on data_segment_t allocation\n");
-                return -1;
+        // the deferred write is prepared before taking the token, so a failure never leaves the token held
+        if (priority == LOW_PRIORITY) {
+                task = alloc_async_task(device, session->flags);
+                if (task == NULL) {
+                        pr_info("Failure on async_task_t allocation\n");
+                        res = is_blocking(session->flags) ? -ENOMEM : -EAGAIN;
+                        goto free_area;
+                }
         }
 
-        // setup for blocking or non-blocking operation
-        res = init_operation(flow, session, minor, "write");
-        if (!res) goto free_area; //else we have the lock
-        
-        // set the correct number of bytes to be written
-        if (len - byte_not_copied > free_space(session->priority, minor)) len = free_space(session->priority, minor);
-        else len = len - byte_not_copied;
-        init_data_segment(to_write, tmp_buf, len);
+        while (true) {
+                // setup for blocking or non-blocking operation
+                res = init_operation(flow, session, minor, "write", len);
+                if (res <= 0) goto free_area; //else we have the lock
+                
+                // set the correct number of bytes to be written, charging them to the flow and to the shared budget
+                granted = reserve_space(flow, used_space(priority, minor), copied);
+                if (granted > 0) break;
+                mutex_unlock(&(flow->op_mutex));
+                if (!is_blocking(session->flags)) {
+                        pr_debug("Operation aborted: Token acquired but the memory budget is exhausted, no data can be writed.\n");
+                        res = -EAGAIN;
+                        goto free_area;
+                }
+                // blocking writers wait for the budget given back by any flow, then try again
+                pr_debug("Memory budget exhausted, thread goes in wait...\n");
+                res = wait_event_interruptible_timeout(budget_waitqueue, budget_available(used_space(priority, minor)),
+                                                       msecs_to_jiffies(session->timeout*1000));
+                if (res == 0) goto free_area;
+                if (res == -ERESTARTSYS) {
+                        res = -EINTR;
+                        goto free_area;
+                }
+        }
+        len = granted;
+        trim_data_chain(&to_write, len);
 
-        pr_info("Start effective write.\n");
+        pr_debug("Start effective write.\n");
+        flow->writes++;
 
         // check if data segment must be write in a synchronous way
-        if (session->priority == HIGH_PRIORITY) {
-                pr_info("The selected operation is required at high priority.\n");
-                write_data_segment(flow, to_write);
+        if (priority == HIGH_PRIORITY) {
+                pr_debug("The selected operation is required at high priority.\n");
+                write_data_chain(flow, &to_write);
                 add_to_buffer(HIGH_PRIORITY, minor, len);
-                wake_up_interruptible(&(flow->waitqueue));
-                pr_info("Operation completed, bytes writed to the device at high priority: %s\n", tmp_buf);
+                update_writers(flow, HIGH_PRIORITY, minor);
+                pr_debug("Operation completed, %zu bytes writed to the device at high priority.\n", len);
         } 
         else {
-                pr_info("The selected operation is required at low priority.\n");
+                pr_debug("The selected operation is required at low priority.\n");
                 // setup the async task
-                task = kmalloc(sizeof(async_task_t), session->flags);
-                if (task == NULL) {
-                        pr_info("Failure on async_task_t allocation\n");
-                        return -1;
-                }
-                task->to_write = to_write;
+                list_splice_init(&to_write, &(task->to_write));
+                task->size = len;
                 task->session = session;
                 task->minor = minor;
+                task->deadline = jiffies + msecs_to_jiffies(session->deferral);
+
+                // the task keeps the session alive until the write is committed, fsync/flush wait on pending
+                kref_get(&(session->refcount));
+                atomic_inc(&(session->pending));
 
-                // initialize an already declared delayed_work item with a deffered write handler
-                pr_info("Insert thread in the workqueue...\n");
-                INIT_DELAYED_WORK(&(task->del_work), (void *)async_write);
+                // append the task to the batch of deferred writes of the device, committed in FIFO order
+                pr_debug("Insert deferred write in the pending batch...\n");
+                list_add_tail(&(task->entry), &(device->pending));
+                device->pending_bytes += len;
+                device->pending_writes++;
                 
                 // reserve logical space for the deferred write: next writes knows that this space is occupied
                 // in this way the user is immediately notified of the completation of the operation
                 // it will be the deamon, which will be scheduled when the kernel decides, to actually complete the write
                 add_to_buffer(LOW_PRIORITY, minor, len);
+                update_writers(flow, LOW_PRIORITY, minor);
                 
-                // insert the async task in the workqueue associated to the device after a delay of 5sec
-                queue_delayed_work(device->workqueue, &(task->del_work), msecs_to_jiffies(5000));
+                // commit immediately if readers are parked or the batch is big enough, otherwise within the deadline
+                if (must_commit(device)) schedule_commit(device, jiffies);
+                else schedule_commit(device, task->deadline);
 
         }
 
-        // release token acquired in init operation
-        // the queue is not woken up at low priority because we schedule a deferred work, so this is executed later
-        mutex_unlock(&(device->flow[session->priority]->op_mutex));
+        // release token acquired in init operation, then pass the baton to the next writer
+        // the readers are not woken up at low priority because we schedule a deferred work, so this is executed later
+        mutex_unlock(&(flow->op_mutex));
+        wake_up_writers(flow, priority, minor);
+        if (priority == HIGH_PRIORITY) wake_up_readers(flow, HIGH_PRIORITY, minor);
         return len;
 
         // label for manage memory release in case of error
-free_area:      kfree(tmp_buf);
-                free_data_segment(to_write);
-                kfree(task);
+free_area:      if (task) free_async_task(device, task);
+                free_data_chain(&to_write);
                 return res;
 }
 
@@ -254,7 +579,6 @@ static ssize_t device_read(struct file *filp, char *buff, size_t len, loff_t *of
         int res;
         int minor;
         char *tmp_buf;
-        char *final;
         ssize_t valid;
         device_manager_t *device;
         session_t *session;
@@ -264,83 +588,236 @@ static ssize_t device_read(struct file *filp, char *buff, size_t len, loff_t *of
         minor = get_minor(filp);
         device = devices + minor;
         session = (session_t *)filp->private_data;
-        flow = device->flow[session->priority];
+        flow = &(device->flow[session->priority]);
 
-        pr_info("Read operation called for minor: %d\n", minor);
+        pr_debug("Read operation called for minor: %d\n", minor);
         if (len <= 0) return 0;
+        if (len > flow_max_bytes) len = flow_max_bytes;
 
-        tmp_buf = kmalloc(len, session->flags);
+        tmp_buf = kvmalloc(len, session->flags);
         if (tmp_buf == NULL) {
                 pr_info("Failure on char* allocation\n");
                 return -1;
         }
 
         // setup for blocking or non-blocking operation
-        res = init_operation(flow, session, minor, "read");
-        if (!res) goto free_area; //else we have the lock
+        res = init_operation(flow, session, minor, "read", len);
+        if (res <= 0) goto free_area; //else we have the lock
         
         // set the correct number of bytes to be read
         if(len > byte_to_read(session->priority, minor)) len = byte_to_read(session->priority, minor);
         
-        pr_info("Start effective read.\n");
+        pr_debug("Start effective read.\n");
+        flow->reads++;
         
         read_from_flow(flow, tmp_buf, len);
         sub_to_buffer(session->priority,minor,len);
-        wake_up_interruptible(&(flow->waitqueue));
+        release_space(flow, used_space(session->priority, minor));
+        update_writers(flow, session->priority, minor);
         mutex_unlock(&(flow->op_mutex));
+        wake_up_writers(flow, session->priority, minor);
+        wake_up_readers(flow, session->priority, minor);
         
         // copy data readed on a buffer, from kernel to user space returns # of bytes that could not be copied  
         res = copy_to_user(buff,tmp_buf,len);
         valid = len - res;
-        final = kmalloc(valid, session->flags);
-        if (final == NULL) {
+        kvfree(tmp_buf);
+
+        pr_debug("Operation completed, bytes readed from the device: %zu\n", valid);
+        return valid;
+
+        // label for manage memory release in case of error
+free_area:      kvfree(tmp_buf);
+                return res;
+}
+
+/**
+ * device_poll - readiness of a minor for poll/select
+ * @filp:       I/O session to the device file
+ * @wait:       poll table to register on the waitqueue of the flow
+ *
+ * The flow of the session is readable when at least low watermark bytes are available, as for blocking reads.
+ * It is writable when the writers are not throttled and the memory budget has room for the flow.
+ */
+static __poll_t device_poll(struct file *filp, poll_table *wait) {
+        int minor;
+        __poll_t mask;
+        session_t *session;
+        flow_manager_t *flow;
+
+        minor = get_minor(filp);
+        session = (session_t *)filp->private_data;
+        flow = &(devices[minor].flow[session->priority]);
+        mask = 0;
+
+        poll_wait(filp, &(flow->poll_waitqueue), wait);
+        poll_wait(filp, &(flow->wr_waitqueue), wait);
+        poll_wait(filp, &budget_waitqueue, wait);
+        // the wakeups of the readers side follow the smallest low watermark among the pollers (see wake_up_pollers)
+        spin_lock(&(flow->poll_waitqueue.lock));
+        if (session->lowat < flow->min_poll_threshold) WRITE_ONCE(flow->min_poll_threshold, session->lowat);
+        spin_unlock(&(flow->poll_waitqueue.lock));
+        smp_mb();
+        // expired data segments must not be reported as readable, if the token is busy its holder drops them
+        if (READ_ONCE(flow->ttl) && mutex_trylock(&(flow->op_mutex))) {
+                expire_segments(flow, session->priority, minor);
+                mutex_unlock(&(flow->op_mutex));
+                wake_up_writers(flow, session->priority, minor);
+        }
+        if (byte_to_read(session->priority, minor) >= session->lowat) mask |= EPOLLIN | EPOLLRDNORM;
+        // a write must also find room in the memory budget, otherwise it would fail with -EAGAIN
+        if (!flow->throttled && used_space(session->priority, minor) < flow->high_watermark &&
+            budget_available(used_space(session->priority, minor))) mask |= EPOLLOUT | EPOLLWRNORM;
+        return mask;
+}
+
+/**
+ * device_peek - read operation for a minor that does not consume data from the flow
+ * @filp:       I/O session to the device file
+ * @buff:       pointer to a buffer that contains inspected data
+ * @len:        number of bytes to be inspected
+ * 
+ * Returns:
+ *  - # of inspected bytes when the operation is successful
+ *  - a negative value when error occurs
+ */
+static ssize_t device_peek(struct file *filp, char *buff, size_t len) {
+        int res;
+        int minor;
+        char *tmp_buf;
+        session_t *session;
+        flow_manager_t *flow;
+
+        minor = get_minor(filp);
+        session = (session_t *)filp->private_data;
+        flow = &(devices[minor].flow[session->priority]);
+
+        pr_debug("Peek operation called for minor: %d\n", minor);
+        if (len <= 0) return 0;
+        if (len > flow_max_bytes) len = flow_max_bytes;
+
+        tmp_buf = kvmalloc(len, session->flags);
+        if (tmp_buf == NULL) {
                 pr_info("Failure on char* allocation\n");
                 return -1;
         }
-        memcpy(final, tmp_buf, valid);
 
-        pr_info("Operation completed, bytes readed from the device: %zu, %s\n", valid, final);
-        return valid;
+        // setup for blocking or non-blocking operation, same rules of a read
+        res = init_operation(flow, session, minor, "read", len);
+        if (res <= 0) goto free_area; //else we have the lock
 
-        // label for manage memory release in case of error
-free_area:      kfree(tmp_buf);
+        if (len > byte_to_read(session->priority, minor)) len = byte_to_read(session->priority, minor);
+        peek_flow(flow, tmp_buf, len);
+        mutex_unlock(&(flow->op_mutex));
+
+        // data are still in the flow, so other readers can go on, writers if expired data segments were dropped
+        wake_up_writers(flow, session->priority, minor);
+        wake_up_readers(flow, session->priority, minor);
+        res = len - copy_to_user(buff, tmp_buf, len);
+
+        // label for manage memory release at the end of the operation
+free_area:      kvfree(tmp_buf);
                 return res;
 }
 
+/**
+ * device_discard - consume data from the flow of a minor without copying them to user space
+ * @filp:       I/O session to the device file
+ * @len:        number of bytes to be discarded
+ * 
+ * Returns:
+ *  - # of discarded bytes when the operation is successful
+ *  - a negative value when error occurs
+ */
+static ssize_t device_discard(struct file *filp, size_t len) {
+        int res;
+        int minor;
+        session_t *session;
+        flow_manager_t *flow;
+
+        minor = get_minor(filp);
+        session = (session_t *)filp->private_data;
+        flow = &(devices[minor].flow[session->priority]);
+
+        pr_debug("Discard operation called for minor: %d\n", minor);
+        if (len <= 0) return 0;
+
+        // setup for blocking or non-blocking operation, same rules of a read
+        res = init_operation(flow, session, minor, "read", len);
+        if (res <= 0) return res; //else we have the lock
+
+        if (len > byte_to_read(session->priority, minor)) len = byte_to_read(session->priority, minor);
+        discard_from_flow(flow, len);
+        sub_to_buffer(session->priority, minor, len);
+        release_space(flow, used_space(session->priority, minor));
+        update_writers(flow, session->priority, minor);
+        mutex_unlock(&(flow->op_mutex));
+        wake_up_writers(flow, session->priority, minor);
+        wake_up_readers(flow, session->priority, minor);
+
+        pr_debug("Operation completed, bytes discarded from the device: %zu\n", len);
+        return len;
+}
+
 /**
  * init_operation - try to setup and initialize a blocking or non-blocking read/write for a specific minor
  * @manager:    object that handles data structures for a specific minor
  * @session:    I/O session to the device file
  * @minor:      minor number of the device file
  * @type:       type of operation, read or write
+ * @len:        number of bytes requested by the operation
  * 
+ * A blocking read waits until at least min(low watermark, @len) bytes are available, when the timeout
+ * elapses it goes on with the bytes available at that instant.
+ *
  * Returns:
  *  - 1 if the operation is completed successfully (lock acquired and condition checked for read/write),
  *  - 0 or a specific error otherwise.
  */
-int init_operation(flow_manager_t *flow, session_t *session, int minor, char *type) {
+int init_operation(flow_manager_t *flow, session_t *session, int minor, char *type, size_t len) {
         int res;
         if (strcmp(type, "read") != 0 && strcmp(type, "write") != 0) { return 0; }
 
         // check if thread must block
         if(is_blocking(session->flags)) {
-                pr_info("The selected operation is of blocking type.\n");
+                pr_debug("The selected operation is of blocking type.\n");
                 inc_thread_in_wait(session->priority, minor);
-                pr_info("Increased number of threads in wait (+1).\n");
+                pr_debug("Increased number of threads in wait (+1).\n");
                 
-                pr_info("Thread goes in wait...\n");
+                pr_debug("Thread goes in wait...\n");
                 // BLOCKING READ: wait until the lock is available and then check if there are bytes to read
                 if (strcmp(type, "read") == 0) { 
-                        res = wait_event_interruptible_exclusive_timeout(flow->waitqueue, lock_and_awake(
-                              byte_to_read(session->priority,minor) > 0, &(flow->op_mutex)), msecs_to_jiffies(session->timeout*1000)); 
+                        // a parked reader forces the commit of the pending batch of deferred writes
+                        enter_read_wait(flow, read_threshold(session, len));
+                        if (session->priority == LOW_PRIORITY) {
+                                mutex_lock(&(flow->op_mutex));
+                                if (devices[minor].pending_writes > 0) schedule_commit(devices + minor, jiffies);
+                                mutex_unlock(&(flow->op_mutex));
+                        }
+                        // the reader spins for the busy-poll budget of the session before going to sleep
+                        if (session->busy_poll > 0 && busy_poll_flow(flow, session, minor, len)) res = 1;
+                        else res = wait_event_interruptible_timeout(flow->waitqueue, lock_and_awake(
+                              readable_bytes(flow, session->priority, minor) >= read_threshold(session, len), &(flow->op_mutex)), 
+                              msecs_to_jiffies(session->timeout*1000)); 
+                        exit_read_wait(flow);
+
+                        // timeout elapsed below the low watermark: read what is available
+                        if (res == 0) {
+                                mutex_lock(&(flow->op_mutex));
+                                if (readable_bytes(flow, session->priority, minor) > 0) res = 1;
+                                else {
+                                        mutex_unlock(&(flow->op_mutex));
+                                        wake_up_writers(flow, session->priority, minor);
+                                }
+                        }
                 }
-                // BLOCKING WRITE: wait until the lock is available and then check if there is space to write
+                // BLOCKING WRITE: wait until the lock is available and then check if the writers are not throttled
                 if (strcmp(type, "write") == 0) { 
-                        res = wait_event_interruptible_exclusive_timeout(flow->waitqueue, lock_and_awake(
-                              is_free(session->priority,minor), &(flow->op_mutex)), msecs_to_jiffies(session->timeout*1000)); 
+                        res = wait_event_interruptible_exclusive_timeout(flow->wr_waitqueue, lock_and_awake(
+                              can_write(flow, session->priority, minor), &(flow->op_mutex)), msecs_to_jiffies(session->timeout*1000)); 
                 }
                 dec_thread_in_wait(session->priority, minor);
-                pr_info("Decreased number of threads in wait (-1).\n");
+                pr_debug("Decreased number of threads in wait (-1).\n");
 
                 // check if error on wait: token not available after timeout elapsed or signal interruption
                 if (res == 0) { return res; }
@@ -348,27 +825,26 @@ int init_operation(flow_manager_t *flow, session_t *session, int minor, char *ty
         }
         else {
                 // check if token is available
-                pr_info("The selected operation is of non-blocking type.\n");
+                pr_debug("The selected operation is of non-blocking type.\n");
                 if (!mutex_trylock(&(flow->op_mutex))) {
-                        pr_info("Operation aborted: Token already in use by another thread.\n");
+                        pr_debug("Operation aborted: Token already in use by another thread.\n");
                         return -EBUSY;
                 }
                 // NON-BLOCKING READ
                 if (strcmp(type, "read") == 0) {
                         // check if data to read are available
-                        if (is_empty(session->priority,minor)) {
-                                pr_info("Operation aborted: Token acquired but the buffer is empty, no data to be read.\n");
-                                wake_up_interruptible(&(flow->waitqueue));
+                        if (readable_bytes(flow, session->priority, minor) == 0) {
+                                pr_debug("Operation aborted: Token acquired but the buffer is empty, no data to be read.\n");
                                 mutex_unlock(&(flow->op_mutex));
+                                wake_up_writers(flow, session->priority, minor);
                                 return 0;
                         }
                 }
                 // NON-BLOCKING WRITE
                 if (strcmp(type, "write") == 0) {
                         // check if data can be writed
-                        if (is_free(session->priority,minor)) {
-                                pr_info("Operation aborted: Token acquired but the buffer is full, no data can be writed.\n");
-                                wake_up_interruptible(&(flow->waitqueue));
+                        if (!can_write(flow, session->priority, minor)) {
+                                pr_debug("Operation aborted: Token acquired but the buffer is full, no data can be writed.\n");
                                 mutex_unlock(&(flow->op_mutex));
                                 return 0;
                         }
@@ -379,36 +855,371 @@ int init_operation(flow_manager_t *flow, session_t *session, int minor, char *ty
 }
 
 /**
- * async_write - asynchronous write for low priority flow
- * @data:      pointer to the delayed_work struct that runs the deffered write
+ * enter_read_wait - registration of a blocking reader that is going to wait on the flow
+ * @flow:       flow manager of the flow to read
+ * @threshold:  bytes to read that complete the wait of the reader
+ *
+ * The smallest threshold is kept until the last reader leaves the waitqueue: a threshold of a reader 
+ * already gone can only cause a spurious wakeup, never a missed one (see wake_up_readers).
+ */
+void enter_read_wait(flow_manager_t *flow, long threshold) {
+        spin_lock(&(flow->waitqueue.lock));
+        atomic_inc(&(flow->readers_in_wait));
+        if (threshold < flow->min_read_threshold) WRITE_ONCE(flow->min_read_threshold, threshold);
+        spin_unlock(&(flow->waitqueue.lock));
+}
+
+/**
+ * exit_read_wait - a blocking reader leaves the waitqueue of the flow
+ * @flow:       flow manager of the flow to read
+ */
+void exit_read_wait(flow_manager_t *flow) {
+        spin_lock(&(flow->waitqueue.lock));
+        if (atomic_dec_and_test(&(flow->readers_in_wait))) WRITE_ONCE(flow->min_read_threshold, LONG_MAX);
+        spin_unlock(&(flow->waitqueue.lock));
+}
+
+/**
+ * wake_up_pollers - wake up the threads in poll/select on the readers side of a flow
+ * @flow:       flow manager of the flow
+ *
+ * Pollers leave the waitqueue without notice, so their smallest low watermark is dropped at each wakeup:
+ * every poller woken calls device_poll again and registers its own low watermark, and a threshold of a
+ * poller already gone can only cause one spurious wakeup.
+ */
+void wake_up_pollers(flow_manager_t *flow) {
+        spin_lock(&(flow->poll_waitqueue.lock));
+        WRITE_ONCE(flow->min_poll_threshold, LONG_MAX);
+        spin_unlock(&(flow->poll_waitqueue.lock));
+        wake_up_interruptible(&(flow->poll_waitqueue));
+}
+
+/**
+ * busy_poll_flow - spin waiting for data to read before the reader goes to sleep on the waitqueue
+ * @flow:       flow manager of the flow to read
+ * @session:    session of the reader, with the busy-poll budget in usecs
+ * @minor:      minor number of the device file
+ * @len:        number of bytes requested by the reader
+ *
+ * The bytes to read are checked without the token, with READ_ONCE so that they are reloaded at each
+ * iteration, and the token is taken with a trylock only when the data seem available. Data already
+ * available on entry are not counted as a hit. The phase ends early when the CPU is needed by another
+ * task or a signal is pending, so the spin never delays the scheduler.
+ *
+ * Returns:
+ *  - 1 if the data are available, with the op_mutex of the flow held,
+ *  - 0 if the budget ran out, the reader has to sleep.
+ */
+int busy_poll_flow(flow_manager_t *flow, session_t *session, int minor, size_t len) {
+        long threshold = read_threshold(session, len);
+        u64 end = local_clock() + session->busy_poll * NSEC_PER_USEC;
+        bool spun = false;
+
+        while (true) {
+                if (byte_to_read_once(session->priority, minor) >= threshold && mutex_trylock(&(flow->op_mutex))) {
+                        if (readable_bytes(flow, session->priority, minor) >= threshold) {
+                                if (spun) atomic_long_inc(&(flow->poll_hits));
+                                return 1;
+                        }
+                        mutex_unlock(&(flow->op_mutex));
+                }
+                if (need_resched() || signal_pending(current) || local_clock() >= end) break;
+                cpu_relax();
+                spun = true;
+        }
+
+        atomic_long_inc(&(flow->poll_misses));
+        return 0;
+}
+
+/**
+ * can_write - check if writers can go on with a write on a flow
+ * @flow:       flow manager of the flow to write
+ * @priority:   priority of the flow
+ * @minor:      minor number of the device file
+ *
+ * Writers are throttled when the bytes in buffer reach the high watermark, and they are 
+ * released only when the bytes in buffer go below the low watermark (see update_writers).
+ * Expired data segments are dropped before the check.
+ * It must be called with the op_mutex of the flow held.
+ */
+int can_write(flow_manager_t *flow, short priority, int minor) {
+        expire_segments(flow, priority, minor);
+        if (!flow->throttled && used_space(priority, minor) >= flow->high_watermark) {
+                flow->throttled = true;
+                update_fill_state(flow, priority, minor);
+        }
+        return !flow->throttled;
+}
+
+/**
+ * readable_bytes - number of bytes that readers can consume from a flow
+ * @flow:       flow manager of the flow to read
+ * @priority:   priority of the flow
+ * @minor:      minor number of the device file
+ *
+ * Expired data segments are dropped before the count.
+ * It must be called with the op_mutex of the flow held.
+ */
+long readable_bytes(flow_manager_t *flow, short priority, int minor) {
+        expire_segments(flow, priority, minor);
+        return byte_to_read(priority, minor);
+}
+
+/**
+ * expire_segments - drop the data segments of a flow older than its time-to-live
+ * @flow:       flow manager of the flow
+ * @priority:   priority of the flow
+ * @minor:      minor number of the device file
+ *
+ * It must be called with the op_mutex of the flow held.
+ */
+void expire_segments(flow_manager_t *flow, short priority, int minor) {
+        long expired;
+        if (flow->ttl == 0) return;
+
+        expired = expire_flow(flow);
+        if (expired == 0) return;
+
+        pr_debug("Expired %ld bytes from the flow with priority %d for minor: %d\n", expired, priority, minor);
+        flow->expired_bytes += expired;
+        sub_to_buffer(priority, minor, expired);
+        release_space(flow, used_space(priority, minor));
+        update_writers(flow, priority, minor);
+}
+
+/**
+ * reap_segments - periodic drop of expired data segments from the flows with a time-to-live
+ * @data:       pointer to the work_struct of the reaper delayed_work
+ *
+ * Flows whose token is in use are skipped, the holder drops the expired data segments by itself.
+ * Writers are woken at each pass, so also a drop made inside the wait condition of a reader is noticed.
+ */
+void reap_segments(struct work_struct *data) {
+        int i;
+        int j;
+        flow_manager_t *flow;
+
+        for (i = 0; i < MINOR_NUMBER; i++) {
+                for (j = 0; j < FLOWS; j++) {
+                        flow = &(devices[i].flow[j]);
+                        if (READ_ONCE(flow->ttl) == 0 || !mutex_trylock(&(flow->op_mutex))) continue;
+                        expire_segments(flow, j, i);
+                        mutex_unlock(&(flow->op_mutex));
+                        wake_up_writers(flow, j, i);
+                }
+        }
+        if (!unloading) schedule_delayed_work(&reaper_work, msecs_to_jiffies(REAPER_PERIOD_MSECS));
+}
+
+/**
+ * update_writers - update the throttling of the writers after a change of the bytes in buffer of a flow
+ * @flow:       flow manager of the flow
+ * @priority:   priority of the flow
+ * @minor:      minor number of the device file
+ *
+ * It must be called with the op_mutex of the flow held, the writers are woken up by the caller
+ * with wake_up_writers after the release of the op_mutex.
+ */
+void update_writers(flow_manager_t *flow, short priority, int minor) {
+        if (flow->throttled && used_space(priority, minor) < flow->low_watermark) flow->throttled = false;
+        update_fill_state(flow, priority, minor);
+}
+
+/**
+ * schedule_commit - schedule the commit of the pending batch of deferred writes of a device
+ * @device:     device manager that handles the pending batch
+ * @deadline:   jiffies within which the commit must run
+ *
+ * The commit is moved earlier if it is already scheduled after @deadline, never later.
+ * It must be called with the op_mutex of the low priority flow held.
+ */
+void schedule_commit(device_manager_t *device, unsigned long deadline) {
+        unsigned long now = jiffies;
+        if (delayed_work_pending(&(device->commit_work)) && !time_before(deadline, device->commit_deadline)) return;
+        device->commit_deadline = deadline;
+        mod_delayed_work(device->workqueue, &(device->commit_work), time_after(deadline, now) ? deadline - now : 0);
+}
+
+/**
+ * async_write - asynchronous write of the batch of deferred writes for low priority flow
+ * @data:      pointer to the work_struct of the delayed_work that commits the batch
  * 
- * Deferred work never fail, so this is scheduled only if all the structures needed are correctly allocated:
+ * Deferred work never fail, so a task is queued only if all the structures needed are correctly allocated:
  *  - async_task_t structure, object to execute and manage a deferred write
- *  - data_segment_t structure, segment to write (+ temporary buffer to store at kernel level the user data to write)
+ *  - data_segment_t structures, chain of segments to write (+ contents to store at kernel level the user data to write)
  * --> we need to ensure also that there is space available on the flow
+ *
+ * The batch is committed in FIFO order up to the last task whose deadline is expired, the whole batch
+ * is committed if readers are parked on the flow or the pending bytes reach the COMMIT_THRESHOLD.
  */
-void async_write(struct delayed_work *data) {
-        // we retrieve the async_task_t struct address using the member delayed_work address, data points to del_work
-        async_task_t *task = container_of((void*)data, async_task_t, del_work);
-        device_manager_t *device = devices + task->minor;
-        flow_manager_t *flow = device->flow[LOW_PRIORITY];
+void async_write(struct work_struct *data) {
+        // we retrieve the device_manager_t struct address using the member delayed_work address
+        device_manager_t *device = container_of(to_delayed_work(data), device_manager_t, commit_work);
+        flow_manager_t *flow = &(device->flow[LOW_PRIORITY]);
+        async_task_t *task, *tmp, *last;
+        unsigned long deadline;
+        LIST_HEAD(batch);
+        bool commit_all;
 
         // wait until token is available
-        pr_info("Started deferred work, waiting for lock...\n");
-        inc_thread_in_wait(task->session->priority, task->minor);
+        pr_debug("Started deferred work, waiting for lock...\n");
         mutex_lock(&(flow->op_mutex));
-        dec_thread_in_wait(task->session->priority, task->minor);
 
-        // write data segment
-        write_data_segment(device->flow[LOW_PRIORITY], task->to_write);
-        pr_info("Operation completed, bytes writed to the device at low priority: %s\n", task->to_write->content);
-        
-        // free memory, release token and wake up the queue
-        kfree(task);
+        // select the tasks to commit, an expired task drags along all the previous ones to keep the FIFO order
+        commit_all = unloading || device->commit_now || must_commit(device);
+        device->commit_now = false;
+        last = NULL;
+        list_for_each_entry(task, &(device->pending), entry) {
+                if (commit_all || !time_before(jiffies, task->deadline)) last = task;
+        }
+        if (last) list_cut_position(&batch, &(device->pending), &(last->entry));
+
+        // write data segments
+        list_for_each_entry(task, &batch, entry) {
+                write_data_chain(flow, &(task->to_write));
+                device->pending_bytes -= task->size;
+                device->pending_writes--;
+                pr_debug("Operation completed, %ld bytes writed to the device at low priority.\n", task->size);
+        }
+
+        // schedule the next commit for the earliest deadline of the remaining tasks
+        if (!list_empty(&(device->pending))) {
+                deadline = list_first_entry(&(device->pending), async_task_t, entry)->deadline;
+                list_for_each_entry(task, &(device->pending), entry) {
+                        if (time_before(task->deadline, deadline)) deadline = task->deadline;
+                }
+                schedule_commit(device, deadline);
+        }
+
+        // release token and wake up the readers
         mutex_unlock(&(flow->op_mutex));
-        wake_up_interruptible(&(device->flow[LOW_PRIORITY]->waitqueue));
+        if (!list_empty(&batch)) wake_up_readers(flow, LOW_PRIORITY, (int)(device - devices));
+
+        // notify the commit to the sessions: eventfd and threads waiting in fsync/flush, then free memory
+        list_for_each_entry_safe(task, tmp, &batch, entry) {
+                spin_lock(&(task->session->eventfd_lock));
+                if (task->session->eventfd) signal_eventfd(task->session->eventfd);
+                spin_unlock(&(task->session->eventfd_lock));
+                if (atomic_dec_and_test(&(task->session->pending))) wake_up_interruptible(&(task->session->sync_waitqueue));
+                kref_put(&(task->session->refcount), release_session);
+                free_async_task(device, task);
+        }
+}
+
+/**
+ * alloc_async_task - allocation of a deferred write from the reserved pool of the device
+ * @device:     device manager with the pool
+ * @flags:      allocation flags of the session
+ *
+ * A blocking session allocates from the slab cache with direct reclaim, the free list and the reserve
+ * of the pool are left to the non-blocking sessions, which cannot wait for memory.
+ *
+ * Returns the deferred write, or NULL if both the slab allocation and the reserve failed.
+ */
+async_task_t *alloc_async_task(device_manager_t *device, gfp_t flags) {
+        async_task_t *task = NULL;
+
+        if (is_blocking(flags)) {
+                task = kmem_cache_alloc(task_cache, flags);
+                if (task == NULL) return NULL;
+                task->pooled = false;
+                INIT_LIST_HEAD(&(task->to_write));
+                return task;
+        }
+
+        // a deferred write of the free list is reused before the pool
+        spin_lock(&(device->free_lock));
+        task = list_first_entry_or_null(&(device->free_tasks), async_task_t, entry);
+        if (task) {
+                list_del(&(task->entry));
+                device->nr_free_tasks--;
+        }
+        spin_unlock(&(device->free_lock));
+        if (task == NULL) task = mempool_alloc(device->task_pool, flags);
+        if (task == NULL) return NULL;
+        task->pooled = true;
+        INIT_LIST_HEAD(&(task->to_write));
+        atomic_inc(&(device->tasks_in_use));
+        return task;
 }
 
+/**
+ * free_async_task - release of a deferred write to the reserved pool of the device
+ * @device:     device manager with the pool
+ * @task:       deferred write to release, with its data segments already committed or freed
+ *
+ * A pooled deferred write is kept in the free list of the device, unless the list is full or the reserve
+ * of the pool has to be refilled first.
+ */
+void free_async_task(device_manager_t *device, async_task_t *task) {
+        if (!task->pooled) {
+                kmem_cache_free(task_cache, task);
+                return;
+        }
+        atomic_dec(&(device->tasks_in_use));
+        if (pool_is_full(device->task_pool)) {
+                spin_lock(&(device->free_lock));
+                if (device->nr_free_tasks < FREE_LIST_LENGTH) {
+                        list_add(&(task->entry), &(device->free_tasks));
+                        device->nr_free_tasks++;
+                        task = NULL;
+                }
+                spin_unlock(&(device->free_lock));
+        }
+        if (task) mempool_free(task, device->task_pool);
+}
+
+/**
+ * init_device_pools - creation of the reserved pools of a device over the caches shared by all the devices
+ * @device:     device manager of the pools
+ *
+ * Returns 0 if all the pools are created, -ENOMEM otherwise (the pools already created are left to free_device_pools).
+ */
+int init_device_pools(device_manager_t *device) {
+        spin_lock_init(&(device->free_lock));
+        INIT_LIST_HEAD(&(device->free_segments));
+        INIT_LIST_HEAD(&(device->free_tasks));
+        device->nr_free_segments = 0;
+        device->nr_free_tasks = 0;
+        device->segment_pool = mempool_create_slab_pool(pool_reserve, segment_cache);
+        device->task_pool = mempool_create_slab_pool(pool_reserve, task_cache);
+        device->chunk_pool = mempool_create_slab_pool(pool_reserve, chunk_cache);
+        atomic_set(&(device->segments_in_use), 0);
+        atomic_set(&(device->tasks_in_use), 0);
+        atomic_set(&(device->chunks_in_use), 0);
+        if (!device->segment_pool || !device->task_pool || !device->chunk_pool) return -ENOMEM;
+        return 0;
+}
+
+/**
+ * free_device_pools - release of the reserved pools of a device, all the elements must be already freed
+ * @device:     device manager of the pools
+ *
+ * The elements kept in the free lists go back to the pools before their destruction.
+ */
+void free_device_pools(device_manager_t *device) {
+        data_segment_t *segment, *next_segment;
+        async_task_t *task, *next_task;
+
+        list_for_each_entry_safe(segment, next_segment, &(device->free_segments), entry) {
+                mempool_free(segment->content, device->chunk_pool);
+                mempool_free(segment, device->segment_pool);
+        }
+        list_for_each_entry_safe(task, next_task, &(device->free_tasks), entry) mempool_free(task, device->task_pool);
+        mempool_destroy(device->segment_pool);
+        mempool_destroy(device->task_pool);
+        mempool_destroy(device->chunk_pool);
+}
+
+/**
+ * free_pool_caches - release of the caches of the reserved pools, after the pools of all the devices
+ */
+void free_pool_caches(void) {
+        kmem_cache_destroy(segment_cache);
+        kmem_cache_destroy(task_cache);
+        kmem_cache_destroy(chunk_cache);
+}
 
 /**
  * Module initialization function
@@ -420,31 +1231,72 @@ int init_module(void) {
 
         // dynamic allocation of major number specifying the base minor number and the count of minor devices
         // device driver --> /proc/devices ; device files --> /dev
+        // each flow must have its minimum bytes granted by the memory budget
+        // the size of a data segment is an int, so no flow may grow beyond it
+        if (flow_max_bytes <= 0 || flow_max_bytes > INT_MAX || flow_min_bytes < 0 || flow_min_bytes > flow_max_bytes ||
+            memory_budget <= 0 || shared_size() < 0) {
+                pr_info("%s: invalid memory budget %ld for %ld-%ld bytes per flow\n", MODNAME, memory_budget, flow_min_bytes, flow_max_bytes);
+                return -EINVAL;
+        }
+        if (pool_reserve <= 0) {
+                pr_info("%s: invalid pool reserve %d\n", MODNAME, pool_reserve);
+                return -EINVAL;
+        }
+
+        // caches of the reserved pools, memory is charged to the memory cgroup of the writer
+        segment_cache = KMEM_CACHE(data_segment, SLAB_ACCOUNT);
+        task_cache = KMEM_CACHE(async_task, SLAB_ACCOUNT);
+        chunk_cache = kmem_cache_create("multi_flow_chunk", POOL_CHUNK_SIZE, 0, SLAB_ACCOUNT, NULL);
+        if (!segment_cache || !task_cache || !chunk_cache) {
+                free_pool_caches();
+                pr_info("%s: cannot create caches of the reserved pools\n", MODNAME);
+                return -ENOMEM;
+        }
+
         major = __register_chrdev(0, 0, MINOR_NUMBER, DEVICE_NAME, &fops);
         if (major < 0) {
+                free_pool_caches();
                 pr_info("%s: cannot allocate major number\n", MODNAME);
                 return major;
         }
         // setup of structures
         for (i = 0; i < MINOR_NUMBER; i++) {
-                // a workqueue and two managers, one for each priority flow of the specific device
+                // reserved pools, a workqueue and two managers, one for each priority flow of the specific device
+                if (init_device_pools(devices + i) < 0) break;
                 devices[i].workqueue = create_singlethread_workqueue("work-queue-" + i);
-                devices[i].flow[LOW_PRIORITY] = kmalloc(sizeof(flow_manager_t), GFP_KERNEL);
-                devices[i].flow[HIGH_PRIORITY] = kmalloc(sizeof(flow_manager_t), GFP_KERNEL);
-                init_flow_manager(devices[i].flow[LOW_PRIORITY]);
-                init_flow_manager(devices[i].flow[HIGH_PRIORITY]);
+                INIT_LIST_HEAD(&(devices[i].pending));
+                INIT_DELAYED_WORK(&(devices[i].commit_work), async_write);
+                init_flow_manager(&(devices[i].flow[LOW_PRIORITY]));
+                init_flow_manager(&(devices[i].flow[HIGH_PRIORITY]));
         }
         // check errors in previous allocations
         if (i < MINOR_NUMBER) {
                 __unregister_chrdev(major, 0, MINOR_NUMBER, DEVICE_NAME);
-                for (; i > -1; i--) {
+                free_device_pools(devices + i);
+                for (i--; i > -1; i--) {
                         destroy_workqueue(devices[i].workqueue);
-                        free_flow(devices[i].flow[LOW_PRIORITY]);
-                        free_flow(devices[i].flow[HIGH_PRIORITY]);
+                        free_flow(&(devices[i].flow[LOW_PRIORITY]));
+                        free_flow(&(devices[i].flow[HIGH_PRIORITY]));
+                        free_device_pools(devices + i);
                 }
+                free_pool_caches();
                 pr_info("Module removed for memory allocation error\n");
                 return -ENOMEM;
         }
+        // sysfs directory with the state of each device
+        if (init_device_attributes() < 0) {
+                __unregister_chrdev(major, 0, MINOR_NUMBER, DEVICE_NAME);
+                for (i = 0; i < MINOR_NUMBER; i++) {
+                        destroy_workqueue(devices[i].workqueue);
+                        free_flow(&(devices[i].flow[LOW_PRIORITY]));
+                        free_flow(&(devices[i].flow[HIGH_PRIORITY]));
+                        free_device_pools(devices + i);
+                }
+                free_pool_caches();
+                pr_info("Module removed for sysfs attributes error\n");
+                return -ENOMEM;
+        }
+        schedule_delayed_work(&reaper_work, msecs_to_jiffies(REAPER_PERIOD_MSECS));
         pr_info("Kernel Module Inserted Successfully...\n");
         pr_info("%s: new driver registered, it is assigned major number %d\n",MODNAME, major);
         return 0;
@@ -456,14 +1308,20 @@ int init_module(void) {
 void cleanup_module(void) {
         int i;
         __unregister_chrdev(major, 0, MINOR_NUMBER, DEVICE_NAME);
+        free_device_attributes();
         pr_info("%s: driver with major number %d unregistered\n",MODNAME, major);
         
-        // deallocation of structures
+        // deallocation of structures, the pending batches are committed without waiting their deadlines
+        unloading = true;
+        cancel_delayed_work_sync(&reaper_work);
         for (i = 0; i < MINOR_NUMBER; i++) {
+                flush_delayed_work(&(devices[i].commit_work));
                 destroy_workqueue(devices[i].workqueue);
-                free_flow(devices[i].flow[LOW_PRIORITY]);
-                free_flow(devices[i].flow[HIGH_PRIORITY]);
+                free_flow(&(devices[i].flow[LOW_PRIORITY]));
+                free_flow(&(devices[i].flow[HIGH_PRIORITY]));
+                free_device_pools(devices + i);
         }
+        free_pool_caches();
 }
 
 MODULE_LICENSE("GPL");
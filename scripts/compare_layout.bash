@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# if less than two arguments supplied, display usage
+if [ $# -ne 2 ]
+then
+    echo "Usage: missing max number of threads and seconds per run of the benchmark\n"
+    exit 1
+fi
+
+root=$(cd $(dirname $0)/.. && pwd)
+results=$(mktemp -d)
+make -C $root/user bench
+
+# the same benchmark on the module built with and without the cache line padding of the per-flow state
+for layout in padded packed
+do
+    if lsmod | grep "multi_flow_device_driver" &> /dev/null ; then
+        sudo rm -f /dev/multi_flow_device_*
+        sudo rmmod multi_flow_device_driver
+    fi
+    if [ $layout = "packed" ]; then packed=1; else packed=0; fi
+    make -C $root/driver all PACKED=$packed
+    sudo insmod $root/driver/multi-flow-device-driver.ko
+    make -C $root/driver clean
+    bash $root/scripts/create_devices.bash $1 > /dev/null
+    echo "Running benchmark on $layout layout..."
+    sudo $root/user/benchmark $1 $2 > $results/$layout || exit 1
+done
+
+# side by side report, the last column is the speedup of the padding
+echo -e "threads\tpadded ops/sec\tpacked ops/sec\tspeedup"
+paste $results/padded $results/packed | tail -n +2 | awk -F '\t' '{ printf "%s\t%s\t\t%s\t\t%.2fx\n", $1, $2, $5, ($5 > 0 ? $2 / $5 : 0) }'
+rm -rf $results
@@ -21,11 +21,6 @@ then
 	exit 1;
 fi
 
-# device file index start from 1 instead of 0 after awk
-index=$(($1+1))
-
-# copy the enabled list in a temporary file, change the enabled flag for the specific minor and re-copy on the original parameter file
-cp /sys/module/multi_flow_device_driver/parameters/enabled /tmp/to_delete
-awk 'BEGIN{FS=OFS=","} {if (NR==1) {$'${index}' = "'${2}'"}; print}' /tmp/to_delete > /sys/module/multi_flow_device_driver/parameters/enabled
-rm /tmp/to_delete
+# change the enabled flag in the sysfs directory of the specific minor
+echo $2 > /sys/module/multi_flow_device_driver/devices/$1/enabled
 echo "Operation completed."
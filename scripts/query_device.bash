@@ -14,21 +14,41 @@ then
 	exit 1
 fi
 
-# device file index start from 1 instead of 0 after cut
-low_index=$(($1+1))
-high_index=$((128+$1+1))
-
-echo "Enabled: "
-cut -d , -f $low_index /sys/module/multi_flow_device_driver/parameters/enabled
-
-echo "Low priority threads in wait: "
-cut -d , -f $low_index /sys/module/multi_flow_device_driver/parameters/threads_in_wait
-
-echo "High priority threads in wait: "
-cut -d , -f $high_index /sys/module/multi_flow_device_driver/parameters/threads_in_wait
-
-echo "Low priority bytes in buffer: "
-cut -d , -f $low_index /sys/module/multi_flow_device_driver/parameters/bytes_in_buffer
-
-echo "High priority bytes in buffer: "
-cut -d , -f $high_index /sys/module/multi_flow_device_driver/parameters/bytes_in_buffer
\ No newline at end of file
+# every minor has its own sysfs directory, the status attribute is a consistent snapshot of all the others
+device="/sys/module/multi_flow_device_driver/devices/$1"
+
+while read name value
+do
+  case $name in
+    enabled)        echo "Enabled: $value" ;;
+    capacity)       echo "Capacity of each flow: $value" ;;
+    lp_threads)     echo "Low priority threads in wait: $value" ;;
+    hp_threads)     echo "High priority threads in wait: $value" ;;
+    lp_bytes)       echo "Low priority bytes in buffer: $value" ;;
+    hp_bytes)       echo "High priority bytes in buffer: $value" ;;
+    lp_fill)        echo "Low priority fill state: $value" ;;
+    hp_fill)        echo "High priority fill state: $value" ;;
+    lp_borrowed)    echo "Low priority bytes borrowed from the shared budget: $value" ;;
+    hp_borrowed)    echo "High priority bytes borrowed from the shared budget: $value" ;;
+    lp_ttl)         echo "Low priority time-to-live (msec): $value" ;;
+    hp_ttl)         echo "High priority time-to-live (msec): $value" ;;
+    lp_expired)     echo "Low priority expired bytes: $value" ;;
+    hp_expired)     echo "High priority expired bytes: $value" ;;
+    lp_reads)       echo "Low priority reads: $value" ;;
+    hp_reads)       echo "High priority reads: $value" ;;
+    lp_writes)      echo "Low priority writes: $value" ;;
+    hp_writes)      echo "High priority writes: $value" ;;
+    pending_bytes)  echo "Pending deferred bytes: $value" ;;
+    pending_writes) echo "Pending deferred writes: $value" ;;
+    lp_poll_hits)   echo "Low priority reads served by busy-poll: $value" ;;
+    hp_poll_hits)   echo "High priority reads served by busy-poll: $value" ;;
+    lp_poll_misses) echo "Low priority busy-polls ended without data: $value" ;;
+    hp_poll_misses) echo "High priority busy-polls ended without data: $value" ;;
+    pool_segments)  echo "Data segments in use: $value" ;;
+    pool_tasks)     echo "Deferred writes in use: $value" ;;
+    pool_chunks)    echo "Payload chunks in use: $value" ;;
+    reserve_segments) echo "Reserved data segments available: $value" ;;
+    reserve_tasks)  echo "Reserved deferred writes available: $value" ;;
+    reserve_chunks) echo "Reserved payload chunks available: $value" ;;
+  esac
+done < $device/status
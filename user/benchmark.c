@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include "lib/defines.h"
+
+#define DEVICE_BASE     "/dev/multi_flow_device_"
+#define MAX_THREADS     128
+#define SEGMENT_SIZE    64
+
+/**
+ * Scaling benchmark of the driver: each thread works on its own minor (0, 1, 2, ...), so adjacent
+ * device managers are used in parallel and any contention between them is false sharing of cache lines.
+ * For 1, 2, 4, ... up to the requested number of threads, each thread is pinned to a CPU and loops
+ * high priority write + read of a small segment for the given duration.
+ */
+
+typedef struct worker {
+        pthread_t tid;
+        int minor;
+        int cpu;
+        double seconds;
+        unsigned long ops;
+        int error;
+} worker_t;
+
+double now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *worker_loop(void *arg) {
+        worker_t *worker = (worker_t *)arg;
+        char path[64];
+        char buf[SEGMENT_SIZE];
+        cpu_set_t set;
+        double end;
+        int fd;
+
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+
+        snprintf(path, sizeof(path), "%s%d", DEVICE_BASE, worker->minor);
+        fd = device_open(path, O_RDWR);
+        if (fd == -1) {
+                worker->error = errno;
+                return NULL;
+        }
+        set_high_priority(fd);
+        set_unblocking_operations(fd);
+        memset(buf, 'a', SEGMENT_SIZE);
+
+        end = now() + worker->seconds;
+        while (now() < end) {
+                if (device_write(fd, buf, SEGMENT_SIZE) != SEGMENT_SIZE || device_read(fd, buf, SEGMENT_SIZE) != SEGMENT_SIZE) {
+                        worker->error = errno;
+                        break;
+                }
+                worker->ops++;
+        }
+        device_release(fd);
+        return NULL;
+}
+
+int main(int argc, char** argv) {
+        worker_t workers[MAX_THREADS];
+        unsigned long total;
+        double single = 0;
+        double seconds;
+        long cpus;
+        int max_threads;
+        int threads;
+        int i;
+
+        // check arguments
+        if (argc < 3) {
+                printf("Usage: sudo ./benchmark [Max Threads] [Seconds per run]\n");
+                return EXIT_FAILURE;
+        }
+        max_threads = atoi(argv[1]);
+        seconds = atof(argv[2]);
+        if (max_threads < 1 || max_threads > MAX_THREADS || seconds <= 0) {
+                printf("Threads must be between 1 and %d, seconds must be positive.\n", MAX_THREADS);
+                return EXIT_FAILURE;
+        }
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        printf("threads\tops/sec\t\tscaling\n");
+        // doubling the threads at each run, the last run always uses the maximum number of threads
+        for (threads = 1; threads <= max_threads; threads = (threads < max_threads && threads * 2 > max_threads) ? max_threads : threads * 2) {
+                memset(workers, 0, sizeof(workers));
+                for (i = 0; i < threads; i++) {
+                        workers[i].minor = i;
+                        workers[i].cpu = i % cpus;
+                        workers[i].seconds = seconds;
+                        pthread_create(&(workers[i].tid), NULL, worker_loop, workers + i);
+                }
+                total = 0;
+                for (i = 0; i < threads; i++) {
+                        pthread_join(workers[i].tid, NULL);
+                        if (workers[i].error) {
+                                printf("error on %s%d: %s (create the devices with scripts/create_devices.bash)\n",
+                                       DEVICE_BASE, workers[i].minor, strerror(workers[i].error));
+                                return EXIT_FAILURE;
+                        }
+                        total += workers[i].ops;
+                }
+                if (threads == 1) single = total / seconds;
+                printf("%d\t%.0f\t%.2fx\n", threads, total / seconds, single > 0 ? (total / seconds) / single : 0);
+        }
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include "lib/defines.h"
+
+/**
+ * Workload capture: shared library loaded with LD_PRELOAD in front of any client of the driver
+ * (e.g. user/user), it wraps the calls behind the macros of /user/lib/defines.h (open, close, read,
+ * write, ioctl, fsync) and records the operations on the device files in a trace file, whose path
+ * is given by the MFD_CAPTURE environment variable (capture.log by default).
+ *
+ * Each line of the trace is an operation:
+ *      <start usec> <duration usec> <thread> <fd> <operation> <arguments...> <result>
+ * where the start is relative to the load of the library, so the trace can be replayed with the
+ * original timing by user/replay. Payloads are not recorded, only sizes.
+ */
+
+#define DEVICE_BASE     "/dev/multi_flow_device_"
+#define CAPTURE_ENV     "MFD_CAPTURE"
+#define CAPTURE_FILE    "capture.log"
+#define MAX_FD          1024
+#define MAX_LINE        512
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_close)(int);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static int (*real_ioctl)(int, unsigned long, ...);
+static int (*real_fsync)(int);
+
+static bool tracked[MAX_FD];
+static int trace_fd = -1;
+static struct timespec origin;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static long elapsed_usec(struct timespec *ts) {
+        return (ts->tv_sec - origin.tv_sec) * 1000000L + (ts->tv_nsec - origin.tv_nsec) / 1000;
+}
+
+__attribute__((constructor)) static void init_capture() {
+        char *path;
+
+        real_open = dlsym(RTLD_NEXT, "open");
+        real_close = dlsym(RTLD_NEXT, "close");
+        real_read = dlsym(RTLD_NEXT, "read");
+        real_write = dlsym(RTLD_NEXT, "write");
+        real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+        real_fsync = dlsym(RTLD_NEXT, "fsync");
+
+        path = getenv(CAPTURE_ENV);
+        if (path == NULL) path = CAPTURE_FILE;
+        trace_fd = real_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        clock_gettime(CLOCK_MONOTONIC, &origin);
+}
+
+/**
+ * record - append an operation to the trace, a single write for each line keeps lines of different threads separated
+ * @start:      time of the call to the driver
+ * @fd:         file descriptor of the device file
+ * @format:     operation name, arguments and result
+ */
+static void record(struct timespec *start, int fd, const char *format, ...) {
+        char line[MAX_LINE];
+        struct timespec end;
+        va_list args;
+        int len;
+
+        if (trace_fd < 0) return;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        len = snprintf(line, MAX_LINE, "%ld %ld %ld %d ", elapsed_usec(start), elapsed_usec(&end) - elapsed_usec(start),
+                       (long)syscall(SYS_gettid), fd);
+        va_start(args, format);
+        len += vsnprintf(line + len, MAX_LINE - len, format, args);
+        va_end(args);
+        if (len >= MAX_LINE - 1) len = MAX_LINE - 2;
+        line[len++] = '\n';
+
+        pthread_mutex_lock(&trace_mutex);
+        real_write(trace_fd, line, len);
+        pthread_mutex_unlock(&trace_mutex);
+}
+
+#define is_tracked(fd) ((fd) >= 0 && (fd) < MAX_FD && tracked[fd])
+
+int open(const char *path, int flags, ...) {
+        struct timespec start;
+        mode_t mode = 0;
+        va_list args;
+        int fd;
+
+        if (flags & O_CREAT) {
+                va_start(args, flags);
+                mode = va_arg(args, mode_t);
+                va_end(args);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fd = real_open(path, flags, mode);
+        if (strncmp(path, DEVICE_BASE, strlen(DEVICE_BASE)) == 0 && fd >= 0 && fd < MAX_FD) {
+                tracked[fd] = true;
+                record(&start, fd, "open %s %d", path, flags & O_ACCMODE);
+        }
+        return fd;
+}
+
+int open64(const char *path, int flags, ...) __attribute__((alias("open")));
+
+int close(int fd) {
+        struct timespec start;
+        int res;
+
+        if (!is_tracked(fd)) return real_close(fd);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        res = real_close(fd);
+        tracked[fd] = false;
+        record(&start, fd, "close %d", res);
+        return res;
+}
+
+ssize_t read(int fd, void *buff, size_t size) {
+        struct timespec start;
+        ssize_t res;
+
+        if (!is_tracked(fd)) return real_read(fd, buff, size);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        res = real_read(fd, buff, size);
+        record(&start, fd, "read %zu %zd", size, res);
+        return res;
+}
+
+ssize_t write(int fd, const void *buff, size_t size) {
+        struct timespec start;
+        ssize_t res;
+
+        if (!is_tracked(fd)) return real_write(fd, buff, size);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        res = real_write(fd, buff, size);
+        record(&start, fd, "write %zu %zd", size, res);
+        return res;
+}
+
+int fsync(int fd) {
+        struct timespec start;
+        int res;
+
+        if (!is_tracked(fd)) return real_fsync(fd);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        res = real_fsync(fd);
+        record(&start, fd, "fsync %d", res);
+        return res;
+}
+
+/**
+ * ioctl - commands with a value are recorded with the value, commands with a structure with its fields
+ */
+int ioctl(int fd, unsigned long cmd, ...) {
+        struct timespec start;
+        unsigned long arg;
+        va_list args;
+        int res;
+
+        va_start(args, cmd);
+        arg = va_arg(args, unsigned long);
+        va_end(args);
+        if (!is_tracked(fd)) return real_ioctl(fd, cmd, arg);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        res = real_ioctl(fd, cmd, arg);
+        switch (cmd) {
+                case MFD_IOC_PEEK:
+                        record(&start, fd, "ioctl %u %llu %d", _IOC_NR(cmd), ((peek_t *)arg)->len, res);
+                        break;
+                case MFD_IOC_WATERMARKS:
+                        record(&start, fd, "ioctl %u %lld %lld %d", _IOC_NR(cmd), ((watermarks_t *)arg)->high,
+                               ((watermarks_t *)arg)->low, res);
+                        break;
+                case MFD_IOC_SET_CONFIG:
+                        record(&start, fd, "ioctl %u %u %u %u %u %llu %u %d", _IOC_NR(cmd), ((session_config_t *)arg)->priority,
+                               ((session_config_t *)arg)->blocking, ((session_config_t *)arg)->timeout,
+                               ((session_config_t *)arg)->deferral, ((session_config_t *)arg)->lowat,
+                               ((session_config_t *)arg)->busy_poll, res);
+                        break;
+                case MFD_IOC_GET_STATUS:
+                        record(&start, fd, "ioctl %u %d", _IOC_NR(cmd), res);
+                        break;
+                default:
+                        record(&start, fd, "ioctl %u %lu %d", _IOC_NR(cmd), arg, res);
+        }
+        return res;
+}
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <unistd.h>
+#include "../../driver/lib/multi-flow-ioctl.h"
 
 #define MAX_BUF_SIZE 50
 
@@ -16,27 +17,37 @@
 #define DISABLE                 7
 #define WRITE                   8
 #define READ                    9
-#define RELEASE                 10
+#define SYNC                    10
+#define STATUS                  11
+#define RELEASE                 12
 
-#define MIN_TIMEOUT 1                                    // minimum amount of seconds for timeout
-#define MAX_TIMEOUT 3600                                 // maximum amount of seconds for timeout
-
-/** ioctl commands re-definition
-*   The ioctl function requires the same values used by the driver: 3,4,5,6,7 as defined in /driver/lib/defines.h 
+/** ioctl commands
+*   Commands and structures are shared with the driver through /driver/lib/multi-flow-ioctl.h 
 */
 
-#define set_high_priority(fd)           ioctl(fd, 3)
-#define set_low_priority(fd)            ioctl(fd, 4)
-#define set_blocking_operations(fd)     ioctl(fd, 5)
-#define set_unblocking_operations(fd)   ioctl(fd, 6)
-#define set_timeout(fd, value)          ioctl(fd, 7, value)
-#define enable_device(fd)               ioctl(fd, 8)
-#define disable_device(fd)              ioctl(fd, 9)
+#define set_high_priority(fd)           ioctl(fd, MFD_IOC_HIGH_PRIORITY)
+#define set_low_priority(fd)            ioctl(fd, MFD_IOC_LOW_PRIORITY)
+#define set_blocking_operations(fd)     ioctl(fd, MFD_IOC_BLOCKING)
+#define set_unblocking_operations(fd)   ioctl(fd, MFD_IOC_UNBLOCKING)
+#define set_timeout(fd, value)          ioctl(fd, MFD_IOC_TIMEOUT, value)
+#define enable_device(fd)               ioctl(fd, MFD_IOC_ENABLE)
+#define disable_device(fd)              ioctl(fd, MFD_IOC_DISABLE)
+#define set_eventfd(fd, efd)            ioctl(fd, MFD_IOC_EVENTFD, efd)
+#define set_deferral(fd, msec)          ioctl(fd, MFD_IOC_DEFERRAL, msec)
+#define device_peek(fd, request)        ioctl(fd, MFD_IOC_PEEK, request)
+#define device_discard(fd, size)        ioctl(fd, MFD_IOC_DISCARD, size)
+#define set_lowat(fd, bytes)            ioctl(fd, MFD_IOC_LOWAT, bytes)
+#define set_watermarks(fd, request)     ioctl(fd, MFD_IOC_WATERMARKS, request)
+#define set_ttl(fd, msec)               ioctl(fd, MFD_IOC_TTL, msec)
+#define set_busy_poll(fd, usec)         ioctl(fd, MFD_IOC_BUSY_POLL, usec)
+#define set_session_config(fd, config)  ioctl(fd, MFD_IOC_SET_CONFIG, config)
+#define get_device_status(fd, status)   ioctl(fd, MFD_IOC_GET_STATUS, status)
 
 /* driver operations */
 #define device_open(path, flags)        open(path, flags)
 #define device_release(fd)              close(fd)
 #define device_read(fd, buff, size)     read(fd, buff, size)
 #define device_write(fd, buff, size)    write(fd, buff, size)
+#define device_sync(fd)                 fsync(fd)
 
 #endif
@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include "lib/defines.h"
+
+/**
+ * Workload replay: re-issues against the device files the operations recorded by the capture library
+ * (see user/capture.c), then reports latency percentiles and throughput for each type of operation.
+ *
+ * Each thread of the captured client is replayed by its own thread, which waits until the start time
+ * of each operation divided by the speed factor (0 to replay as fast as possible). If a device file is
+ * given, every captured device file is replayed on it. Writes use a payload of the recorded size; the
+ * registration of an eventfd cannot be replayed, so it is skipped.
+ */
+
+#define MAX_FD          1024
+#define MAX_THREADS     64
+#define MAX_PATH        128
+#define OPERATIONS      7
+
+enum { OP_OPEN, OP_CLOSE, OP_READ, OP_WRITE, OP_IOCTL, OP_FSYNC, OP_SKIP };
+
+const char *op_names[OPERATIONS] = {"open", "close", "read", "write", "ioctl", "fsync", "skip"};
+
+typedef struct operation {
+        long start;
+        int tid;
+        int fd;
+        int type;
+        char path[MAX_PATH];
+        int flags;
+        unsigned int cmd;
+        unsigned long long args[6];
+        size_t size;
+        long latency;
+        long bytes;
+} operation_t;
+
+typedef struct replayer {
+        pthread_t thread;
+        int tid;
+        operation_t **operations;
+        int count;
+} replayer_t;
+
+operation_t *operations;
+int op_count;
+replayer_t replayers[MAX_THREADS];
+int replayer_count;
+int fds[MAX_FD];
+pthread_mutex_t fds_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct timespec origin;
+double speed;
+char *device_path;
+
+long now_usec() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (ts.tv_sec - origin.tv_sec) * 1000000L + (ts.tv_nsec - origin.tv_nsec) / 1000;
+}
+
+/**
+ * parse_line - parse a line of the trace
+ *
+ * Returns 0 if the line is a valid operation, -1 otherwise.
+ */
+int parse_line(char *line, operation_t *op) {
+        char name[16];
+        long duration;
+        int offset;
+
+        memset(op, 0, sizeof(operation_t));
+        if (sscanf(line, "%ld %ld %d %d %15s %n", &(op->start), &duration, &(op->tid), &(op->fd), name, &offset) < 5) return -1;
+        if (op->fd < 0 || op->fd >= MAX_FD) return -1;
+        line += offset;
+
+        if (strcmp(name, "open") == 0) {
+                op->type = OP_OPEN;
+                if (sscanf(line, "%127s %d", op->path, &(op->flags)) < 2) return -1;
+        } else if (strcmp(name, "close") == 0) {
+                op->type = OP_CLOSE;
+        } else if (strcmp(name, "read") == 0) {
+                op->type = OP_READ;
+                if (sscanf(line, "%zu", &(op->size)) < 1) return -1;
+        } else if (strcmp(name, "write") == 0) {
+                op->type = OP_WRITE;
+                if (sscanf(line, "%zu", &(op->size)) < 1) return -1;
+        } else if (strcmp(name, "fsync") == 0) {
+                op->type = OP_FSYNC;
+        } else if (strcmp(name, "ioctl") == 0) {
+                op->type = OP_IOCTL;
+                if (sscanf(line, "%u %llu %llu %llu %llu %llu %llu", &(op->cmd), op->args, op->args + 1, op->args + 2,
+                           op->args + 3, op->args + 4, op->args + 5) < 1) return -1;
+                if (op->cmd == _IOC_NR(MFD_IOC_EVENTFD)) op->type = OP_SKIP;
+        } else {
+                return -1;
+        }
+        return 0;
+}
+
+/**
+ * issue_ioctl - re-issue a recorded ioctl, structures are rebuilt from the recorded fields
+ */
+int issue_ioctl(int fd, operation_t *op) {
+        watermarks_t watermarks;
+        session_config_t config;
+        device_status_t status;
+        peek_t peek;
+        char *buff;
+        int res;
+
+        switch (op->cmd) {
+                case _IOC_NR(MFD_IOC_PEEK):
+                        buff = malloc(op->args[0] + 1);
+                        peek.buff = (__u64)(unsigned long)buff;
+                        peek.len = op->args[0];
+                        res = device_peek(fd, &peek);
+                        free(buff);
+                        return res;
+                case _IOC_NR(MFD_IOC_WATERMARKS):
+                        watermarks.high = op->args[0];
+                        watermarks.low = op->args[1];
+                        return set_watermarks(fd, &watermarks);
+                case _IOC_NR(MFD_IOC_SET_CONFIG):
+                        memset(&config, 0, sizeof(session_config_t));
+                        config.priority = op->args[0];
+                        config.blocking = op->args[1];
+                        config.timeout = op->args[2];
+                        config.deferral = op->args[3];
+                        config.lowat = op->args[4];
+                        config.busy_poll = op->args[5];
+                        return set_session_config(fd, &config);
+                case _IOC_NR(MFD_IOC_GET_STATUS):
+                        return get_device_status(fd, &status);
+                default:
+                        return ioctl(fd, _IO(MFD_IOC_MAGIC, op->cmd), op->args[0]);
+        }
+}
+
+/**
+ * issue - re-issue a recorded operation and measure its latency
+ */
+void issue(operation_t *op, char *buff) {
+        long start;
+        long res = 0;
+        int fd;
+
+        pthread_mutex_lock(&fds_mutex);
+        fd = fds[op->fd];
+        pthread_mutex_unlock(&fds_mutex);
+        if (op->type != OP_OPEN && fd < 0) {
+                op->type = OP_SKIP;
+                return;
+        }
+
+        start = now_usec();
+        switch (op->type) {
+                case OP_OPEN:
+                        fd = device_open(device_path ? device_path : op->path, op->flags);
+                        pthread_mutex_lock(&fds_mutex);
+                        fds[op->fd] = fd;
+                        pthread_mutex_unlock(&fds_mutex);
+                        break;
+                case OP_CLOSE:
+                        device_release(fd);
+                        pthread_mutex_lock(&fds_mutex);
+                        fds[op->fd] = -1;
+                        pthread_mutex_unlock(&fds_mutex);
+                        break;
+                case OP_READ:
+                        res = device_read(fd, buff, op->size);
+                        break;
+                case OP_WRITE:
+                        res = device_write(fd, buff, op->size);
+                        break;
+                case OP_FSYNC:
+                        device_sync(fd);
+                        break;
+                case OP_IOCTL:
+                        issue_ioctl(fd, op);
+                        break;
+        }
+        op->latency = now_usec() - start;
+        op->bytes = res > 0 ? res : 0;
+}
+
+void *replay_thread(void *arg) {
+        replayer_t *replayer = (replayer_t *)arg;
+        operation_t *op;
+        size_t max_size = 1;
+        char *buff;
+        long wait;
+        int i;
+
+        for (i = 0; i < replayer->count; i++)
+                if (replayer->operations[i]->size > max_size) max_size = replayer->operations[i]->size;
+        buff = malloc(max_size);
+        memset(buff, 'a', max_size);
+
+        for (i = 0; i < replayer->count; i++) {
+                op = replayer->operations[i];
+                if (op->type == OP_SKIP) continue;
+                if (speed > 0) {
+                        wait = (long)(op->start / speed) - now_usec();
+                        if (wait > 0) usleep(wait);
+                }
+                issue(op, buff);
+        }
+        free(buff);
+        return NULL;
+}
+
+int compare_latency(const void *a, const void *b) {
+        long x = *(const long *)a;
+        long y = *(const long *)b;
+        return (x > y) - (x < y);
+}
+
+/**
+ * report - latency percentiles and throughput of each type of operation
+ */
+void report(long elapsed) {
+        long *latencies;
+        long bytes;
+        long total = 0;
+        int count;
+        int type;
+        int i;
+
+        latencies = malloc(sizeof(long) * (op_count + 1));
+        printf("elapsed %.3f s\n", elapsed / 1e6);
+        printf("op\tcount\tp50 us\tp99 us\tmax us\tops/sec\t\tMB/s\n");
+        for (type = 0; type < OP_SKIP; type++) {
+                count = 0;
+                bytes = 0;
+                for (i = 0; i < op_count; i++) {
+                        if (operations[i].type != type) continue;
+                        latencies[count++] = operations[i].latency;
+                        bytes += operations[i].bytes;
+                }
+                if (count == 0) continue;
+                total += count;
+                qsort(latencies, count, sizeof(long), compare_latency);
+                printf("%s\t%d\t%ld\t%ld\t%ld\t%.0f\t\t%.3f\n", op_names[type], count, latencies[count / 2],
+                       latencies[(count * 99) / 100], latencies[count - 1], count / (elapsed / 1e6),
+                       bytes / (elapsed / 1e6) / (1024 * 1024));
+        }
+        printf("total\t%ld\t\t\t\t%.0f\n", total, total / (elapsed / 1e6));
+        free(latencies);
+}
+
+int main(int argc, char** argv) {
+        char line[512];
+        FILE *trace;
+        int capacity = 1024;
+        long elapsed;
+        int i, j;
+
+        // check arguments
+        if (argc < 2) {
+                printf("Usage: sudo ./replay [Trace File] [Speed, 1 original, 0 as fast as possible] [Device File Path]\n");
+                return EXIT_FAILURE;
+        }
+        speed = argc > 2 ? atof(argv[2]) : 1;
+        device_path = argc > 3 ? argv[3] : NULL;
+        if (speed < 0) {
+                printf("Speed must not be negative.\n");
+                return EXIT_FAILURE;
+        }
+
+        // load of the trace
+        trace = fopen(argv[1], "r");
+        if (trace == NULL) {
+                printf("cannot open trace file %s\n", argv[1]);
+                return EXIT_FAILURE;
+        }
+        operations = malloc(sizeof(operation_t) * capacity);
+        while (fgets(line, sizeof(line), trace)) {
+                if (op_count == capacity) {
+                        capacity *= 2;
+                        operations = realloc(operations, sizeof(operation_t) * capacity);
+                }
+                if (parse_line(line, operations + op_count) == 0) op_count++;
+        }
+        fclose(trace);
+        if (op_count == 0) {
+                printf("no operations in trace file %s\n", argv[1]);
+                return EXIT_FAILURE;
+        }
+
+        // operations of each captured thread, in order of start
+        for (i = 0; i < op_count; i++) {
+                for (j = 0; j < replayer_count && replayers[j].tid != operations[i].tid; j++);
+                if (j == replayer_count) {
+                        if (replayer_count == MAX_THREADS) {
+                                printf("too many threads in trace file, at most %d\n", MAX_THREADS);
+                                return EXIT_FAILURE;
+                        }
+                        replayers[j].tid = operations[i].tid;
+                        replayers[j].operations = malloc(sizeof(operation_t *) * op_count);
+                        replayer_count++;
+                }
+                replayers[j].operations[replayers[j].count++] = operations + i;
+        }
+
+        for (i = 0; i < MAX_FD; i++) fds[i] = -1;
+        clock_gettime(CLOCK_MONOTONIC, &origin);
+        for (i = 0; i < replayer_count; i++) pthread_create(&(replayers[i].thread), NULL, replay_thread, replayers + i);
+        for (i = 0; i < replayer_count; i++) pthread_join(replayers[i].thread, NULL);
+        elapsed = now_usec();
+        if (elapsed <= 0) elapsed = 1;
+
+        for (i = 0; i < MAX_FD; i++) if (fds[i] >= 0) device_release(fds[i]);
+        report(elapsed);
+        return EXIT_SUCCESS;
+}
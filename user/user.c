@@ -11,6 +11,7 @@
 
 int priority;
 int fd;
+device_status_t status;
 char *device_path;     
 unsigned long timeout;
 
@@ -34,7 +35,7 @@ int main(int argc, char** argv) {
         }
 
         // default priority is high
-        priority = 1;
+        priority = HIGH_PRIORITY;
 
         // open device
         device_path = argv[1];
@@ -60,7 +61,9 @@ int main(int argc, char** argv) {
                 printf("7.  Disable the device\n");
                 printf("8.  Write\n");
                 printf("9.  Read\n");
-                printf("10. Quit\n");
+                printf("10. Sync pending writes\n");
+                printf("11. Show device status\n");
+                printf("12. Quit\n");
                 printf("What driver operation you want to select?");
                 
                 fgets(buf, MAX_BUF_SIZE, stdin);
@@ -68,13 +71,13 @@ int main(int argc, char** argv) {
                 
                 switch(command) {
                 case TO_HIGH_PRIORITY:
-                        priority = 1;
+                        priority = HIGH_PRIORITY;
                         out_ioctl = set_high_priority(fd);
                         if (out_ioctl == -1) printf("Error setting high priority\n");
                         else printf("Switched to high priority\n");
                         break;
                 case TO_LOW_PRIORITY:
-                        priority = 0;
+                        priority = LOW_PRIORITY;
                         out_ioctl = set_low_priority(fd);
                         if (out_ioctl == -1) printf("Error setting low priority\n");
                         else printf("Switched to low priority\n");
@@ -124,6 +127,22 @@ int main(int argc, char** argv) {
                         if (res == -1) printf("Error on read operation (%s)\n", strerror(errno));
                         else printf("%d bytes are correctly read from device %s\n", res, device_path);
                         break;
+                case SYNC:
+                        res = device_sync(fd);
+                        if (res == -1) printf("Error on sync operation (%s)\n", strerror(errno));
+                        else printf("All pending low priority writes are committed to device %s\n", device_path);
+                        break;
+                case STATUS:
+                        res = get_device_status(fd, &status);
+                        if (res == -1) {
+                                printf("Error on status query (%s)\n", strerror(errno));
+                                break;
+                        }
+                        printf("Enabled: %s\n", status.enabled ? "yes" : "no");
+                        printf("Bytes in buffer (low/high): %lld/%lld\n", (long long)status.bytes[LOW_PRIORITY], (long long)status.bytes[HIGH_PRIORITY]);
+                        printf("Threads in wait (low/high): %lld/%lld\n", (long long)status.threads[LOW_PRIORITY], (long long)status.threads[HIGH_PRIORITY]);
+                        printf("Pending deferred writes: %u (%lld bytes)\n", status.pending_writes, (long long)status.pending_bytes);
+                        break;
                 case RELEASE:
                         device_release(fd);
                         return EXIT_SUCCESS;